@@ -0,0 +1,103 @@
+#pragma once
+
+#include <wav.h>
+#include <functional>
+#include <thread>
+#include <atomic>
+#include <chrono>
+
+// a way of getting audio out of the standalone synth
+// every backend calls back for interleaved stereo float frames one period at a time
+class AudioBackend {
+    public:
+        typedef std::function<void (float *out, int frames)> Callback;
+
+        virtual ~AudioBackend () {}
+
+        // start calling back for periods of frames at a rate
+        // returns false if it couldn't start
+        virtual bool start (Callback callback, int rate, int period) = 0;
+
+        // stop calling back and wait for the last call to finish
+        virtual void stop () = 0;
+
+        // whether it is still calling back
+        virtual bool is_running () = 0;
+
+        // get the number of times the output ran out before a period was ready
+        // for backends that can tell
+        virtual long get_xruns () {
+            return 0;
+        }
+};
+
+// calls back on its own thread every period as a device would but without any sound hardware
+// the output is thrown away or written to a wav file so latency and throughput can be tested anywhere
+class TimerBackend : public AudioBackend {
+    private:
+        const char *path;           // file to write or nullptr to throw the output away
+        SampleFormat format;
+        WavWriter wav;
+        Callback callback;
+        int rate = 44100;
+        int period = 256;
+        float *buffer = nullptr;
+        std::thread thread;
+        std::atomic<bool> running {false};
+        std::atomic<long> xruns {0};
+
+        void run () {
+            auto duration = std::chrono::duration_cast<std::chrono::steady_clock::duration> (std::chrono::duration<double> ((double) period / rate));
+            auto next = std::chrono::steady_clock::now ();
+            while (running.load (std::memory_order_acquire)) {
+                callback (buffer, period);
+                if (path)
+                    wav.write (buffer, period);
+                // a device can't wait for a late period so neither does this
+                next += duration;
+                auto now = std::chrono::steady_clock::now ();
+                if (next < now) {
+                    next = now;
+                    xruns++;
+                }
+                std::this_thread::sleep_until (next);
+            }
+        }
+
+    public:
+        TimerBackend (const char *path = nullptr, SampleFormat format = SAMPLE_INT16)
+            : path (path), format (format) {}
+
+        ~TimerBackend () {
+            stop ();
+            delete[] buffer;
+        }
+
+        bool start (Callback callback, int rate, int period) {
+            stop ();
+            if (path && !wav.open (path, rate, 2, format))
+                return false;
+            this->callback = callback;
+            this->rate = rate;
+            this->period = period;
+            delete[] buffer;
+            buffer = new float[period * 2];
+            running.store (true, std::memory_order_release);
+            thread = std::thread (&TimerBackend::run, this);
+            return true;
+        }
+
+        void stop () {
+            if (running.exchange (false))
+                thread.join ();
+            wav.close ();
+        }
+
+        bool is_running () {
+            return running.load (std::memory_order_acquire);
+        }
+
+        long get_xruns () {
+            return xruns.load ();
+        }
+};
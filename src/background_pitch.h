@@ -0,0 +1,190 @@
+#pragma once
+
+#include <pitch.h>
+
+#ifndef NO_BACKGROUND_PITCH
+
+#include <ring_buffer.h>
+#include <atomic>
+#include <thread>
+#include <chrono>
+#include <cstddef>
+
+// runs a pitch detector on its own thread
+// the audio thread pushes samples into a lock free queue and reads back the latest estimate
+class BackgroundPitchDetector {
+    public:
+        // the result of a detection, small enough to be published atomically
+        struct Estimate {
+            int period;     // period in samples, 0 if there was no peak
+            float level;    // max sample in the window
+        };
+
+    private:
+        static const int queue_size = 1 << 16;  // samples that can be pending before they are dropped
+        PitchDetector detector;
+        RingBuffer<double> queue;
+        std::atomic<Estimate> estimate {Estimate {0, 0}};
+        std::atomic<bool> running {false};
+        std::thread thread;
+        // resets requested by the audio thread and handled by the analysis thread
+        std::atomic<unsigned> resets_requested {0};
+        std::atomic<unsigned> resets_done {0};
+        std::atomic<size_t> reset_position {0};     // samples queued before the last reset
+        // only touched by the audio thread
+        size_t pushed = 0;          // samples queued so far
+        // only touched by the analysis thread while it is running
+        double *window = nullptr;   // ring buffer of the most recent samples
+        int size = 0;
+        int hop = 1;
+        int window_i = 0;
+        int pending = 0;            // samples received since the last detection
+        size_t popped = 0;          // samples taken from the queue so far
+        size_t skip_until = 0;      // samples queued before this are from before a reset
+        unsigned resets = 0;        // resets handled so far
+
+        // forget the window and any samples queued before the last reset
+        void handle_reset () {
+            unsigned requested = resets_requested.load (std::memory_order_acquire);
+            if (requested == resets)
+                return;
+            skip_until = reset_position.load (std::memory_order_relaxed);
+            for (int i = 0; i < size; i++)
+                window[i] = 0;
+            window_i = 0;
+            pending = 0;
+            resets = requested;
+            // anything published before this is stale
+            estimate.store (Estimate {0, 0}, std::memory_order_relaxed);
+            resets_done.store (requested, std::memory_order_release);
+        }
+
+        void analyze () {
+            while (running.load (std::memory_order_acquire)) {
+                double sample;
+                bool idle = true;
+                handle_reset ();
+                while (queue.pop (sample)) {
+                    idle = false;
+                    if (popped++ < skip_until)
+                        continue;
+                    window[window_i] = sample;
+                    if (++window_i == size)
+                        window_i = 0;
+                    if (++pending < hop)
+                        continue;
+                    pending = 0;
+
+                    // the window starts at the oldest sample
+                    Estimate e;
+                    e.period = detector.detect (window, window_i);
+                    e.level = 0;
+                    for (int i = 0; i < size; i++)
+                        if (window[i] > e.level)
+                            e.level = window[i];
+                    estimate.store (e, std::memory_order_release);
+                    handle_reset ();
+                }
+                // nothing to do so give the audio thread time to produce more
+                if (idle)
+                    std::this_thread::sleep_for (std::chrono::milliseconds (1));
+            }
+        }
+
+    public:
+        BackgroundPitchDetector () : queue (queue_size) {}
+        BackgroundPitchDetector (const BackgroundPitchDetector &) = delete;
+        BackgroundPitchDetector &operator= (const BackgroundPitchDetector &) = delete;
+
+        ~BackgroundPitchDetector () {
+            stop ();
+            delete[] window;
+        }
+
+        // start analyzing windows of a given size every hop samples
+        void start (int size, int hop) {
+            stop ();
+            if (size != this->size) {
+                delete[] window;
+                window = new double[size];
+                detector.init (size);
+                this->size = size;
+            }
+            for (int i = 0; i < size; i++)
+                window[i] = 0;
+            this->hop = hop;
+            window_i = 0;
+            pending = 0;
+            queue.clear ();
+            pushed = popped = skip_until = 0;
+            resets = 0;
+            resets_requested.store (0);
+            resets_done.store (0);
+            reset_position.store (0);
+            estimate.store (Estimate {0, 0});
+            running.store (true, std::memory_order_release);
+            thread = std::thread (&BackgroundPitchDetector::analyze, this);
+        }
+
+        // stop the analysis thread and wait for it to finish
+        void stop () {
+            if (running.exchange (false))
+                thread.join ();
+        }
+
+        // forget every sample pushed so far from the audio thread
+        // the analysis thread keeps running and catches up on its own
+        void reset () {
+            reset_position.store (pushed, std::memory_order_relaxed);
+            resets_requested.fetch_add (1, std::memory_order_release);
+        }
+
+        bool is_running () {
+            return running.load (std::memory_order_relaxed);
+        }
+
+        // get the window size
+        int get_size () {
+            return size;
+        }
+
+        // add a sample from the audio thread
+        // samples are dropped if the analysis thread falls behind
+        void push (double sample) {
+            if (queue.push (sample))
+                pushed++;
+        }
+
+        // get the latest estimate from the audio thread
+        // there is none until the analysis thread has seen the last reset
+        Estimate get_estimate () {
+            if (resets_done.load (std::memory_order_acquire) != resets_requested.load (std::memory_order_relaxed))
+                return Estimate {0, 0};
+            return estimate.load (std::memory_order_acquire);
+        }
+};
+
+#else
+
+// stands in for the threaded detector in builds without threads
+// it never finds a period so callers fall back to another kind of detection
+class BackgroundPitchDetector {
+    public:
+        struct Estimate {
+            int period;
+            float level;
+        };
+
+        void start (int size, int hop) { this->size = size; }
+        void stop () {}
+        void reset () {}
+        bool is_running () { return false; }
+        int get_size () { return size; }
+        void push (double sample) {}
+        Estimate get_estimate () { return Estimate {0, 0}; }
+
+    private:
+        int size = 0;
+};
+
+#endif
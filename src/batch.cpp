@@ -0,0 +1,355 @@
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <cstring>
+#include <cmath>
+#include <chrono>
+#include <mutex>
+#include <atomic>
+#include <unistd.h>
+#include <nanceloid.h>
+#include <thread_pool.h>
+#include <wav.h>
+
+using namespace std;
+
+const int block_size = 1024;    // most frames rendered between events
+
+// a single note rendered to its own file
+struct Job {
+    string output;
+    double rate = 44100;
+    double internal_rate = 0;
+    int program = 0;
+    int note = 60;
+    int velocity = 100;
+    double hold = 1;                    // seconds until the note off
+    double tail = 0.5;                  // seconds rendered after it
+    vector<pair<int, float>> params;    // index in the parameter array and value
+};
+
+// shapes saved for patch numbers before every job
+vector<pair<int, TractShape>> shapes;
+vector<Job> jobs;
+
+void exit_error (string message) {
+    cerr << message << endl;
+    exit (EXIT_FAILURE);
+}
+
+void print_usage_and_exit (char *command) {
+    cerr << "Usage: " << command << " [-j threads] [-f format] manifest\n\n";
+    cerr << "-j threads\n\tSpecify the number of jobs rendered at once.\n\tIf left unspecified it is the number of cores.\n\n";
+    cerr << "-f format\n\tSpecify the sample format of the outputs, either 16, 24 or float.\n\tIf left unspecified it is 16.\n\n";
+    cerr << "Each line of the manifest is a shape, a render or a # comment:\n";
+    cerr << "\tshape program=1 velic_closure=0 diameters=0.3,0.5,0.8,0.6\n";
+    cerr << "\trender output=out/{program}_{note}_{velocity}.wav program=0:127 note=48:72:12 velocity=64,127 tract_length=14\n\n";
+    cerr << "Diameters are spread evenly along the tract.\n";
+    cerr << "Render values are lists of numbers and from:to or from:to:step ranges and every combination is rendered.\n";
+    cerr << "Besides program, note and velocity a render takes hold and tail in seconds, rate, internal_rate\n";
+    cerr << "and any parameter by its name in lower case with underscores like adsr_attack.\n";
+    cerr << "{key} in the output is replaced by the value of that key for each file.\n";
+    cerr << flush;
+    exit (EXIT_FAILURE);
+}
+
+// get the manifest key of a parameter like tract_length
+string parameter_key (const char *name) {
+    string key;
+    for (const char *c = name; *c; c++)
+        key += *c == ' ' ? '_' : tolower (*c);
+    return key;
+}
+
+// parse a comma separated list of numbers and ranges
+// returns false if it isn't one
+bool parse_values (const string &text, vector<double> &values) {
+    values.clear ();
+    stringstream items (text);
+    string item;
+    while (getline (items, item, ',')) {
+        double range[3] = {0, 0, 1};
+        int count = 0;
+        const char *p = item.c_str ();
+        while (count < 3) {
+            char *end;
+            range[count++] = strtod (p, &end);
+            if (end == p)
+                return false;
+            p = end;
+            if (*p != ':')
+                break;
+            p++;
+        }
+        if (*p || range[2] <= 0)
+            return false;
+        if (count == 1)
+            values.push_back (range[0]);
+        else
+            for (double v = range[0]; v <= range[1] + 1e-9; v += range[2])
+                values.push_back (v);
+    }
+    return !values.empty ();
+}
+
+// replace every {key} in a template with the values of a job
+string fill_template (const string &text, const vector<pair<string, double>> &values, int line) {
+    string result;
+    size_t i = 0;
+    while (i < text.size ()) {
+        size_t open = text.find ('{', i);
+        if (open == string::npos)
+            break;
+        size_t close = text.find ('}', open);
+        if (close == string::npos)
+            break;
+        result += text.substr (i, open - i);
+        string key = text.substr (open + 1, close - open - 1);
+        bool found = false;
+        for (const pair<string, double> &value : values) {
+            if (value.first == key) {
+                char buffer[32];
+                snprintf (buffer, sizeof (buffer), "%g", value.second);
+                result += buffer;
+                found = true;
+            }
+        }
+        if (!found)
+            exit_error ("Line " + to_string (line) + ": {" + key + "} isn't a key of the render");
+        i = close + 1;
+    }
+    return result + text.substr (i);
+}
+
+// add a shape from a manifest line
+void read_shape (istream &fields, int line) {
+    string field;
+    int program = -1;
+    double velic_closure = 1;
+    vector<double> diameters;
+    while (fields >> field) {
+        size_t equals = field.find ('=');
+        string key = field.substr (0, equals);
+        vector<double> values;
+        if (equals == string::npos || !parse_values (field.substr (equals + 1), values))
+            exit_error ("Line " + to_string (line) + ": bad value " + field);
+        if (key == "program" && values.size () == 1)
+            program = (int) values[0];
+        else if (key == "velic_closure" && values.size () == 1)
+            velic_closure = values[0];
+        else if (key == "diameters" && values.size () >= 2)
+            diameters = values;
+        else
+            exit_error ("Line " + to_string (line) + ": bad value " + field);
+    }
+    if (program < 0 || program > 127 || diameters.empty ())
+        exit_error ("Line " + to_string (line) + ": a shape needs a program from 0 to 127 and diameters");
+
+    // linearly interpolate the diameters to every point of the shape
+    TractShape shape;
+    for (int i = 0; i < TractShape::length; i++) {
+        double position = (double) i / (TractShape::length - 1) * (diameters.size () - 1);
+        int i0 = (int) floor (position);
+        int i1 = min ((int) diameters.size () - 1, i0 + 1);
+        shape.set_sample ((double) i / TractShape::length, diameters[i0] + (diameters[i1] - diameters[i0]) * (position - i0));
+    }
+    shape.velic_closure = velic_closure;
+    shapes.push_back ({program, shape});
+}
+
+// add a job for every combination of values in a manifest line
+void read_render (istream &fields, int line) {
+    Parameters defaults;
+    Parameter *array = defaults.as_array ();
+    string output;
+    vector<pair<string, vector<double>>> keys;
+    string field;
+    while (fields >> field) {
+        size_t equals = field.find ('=');
+        if (equals == string::npos)
+            exit_error ("Line " + to_string (line) + ": expected key=value but got " + field);
+        string key = field.substr (0, equals);
+        if (key == "output") {
+            output = field.substr (equals + 1);
+            continue;
+        }
+        bool known = key == "program" || key == "note" || key == "velocity" || key == "hold" ||
+                     key == "tail" || key == "rate" || key == "internal_rate";
+        for (int i = 0; i < defaults.length (); i++)
+            known |= key == parameter_key (array[i].name);
+        vector<double> values;
+        if (!known)
+            exit_error ("Line " + to_string (line) + ": unknown key " + key);
+        if (!parse_values (field.substr (equals + 1), values))
+            exit_error ("Line " + to_string (line) + ": bad value " + field);
+        keys.push_back ({key, values});
+    }
+    if (output.empty ())
+        exit_error ("Line " + to_string (line) + ": a render needs an output");
+
+    // count through the combinations with the last key changing fastest
+    vector<size_t> indices (keys.size (), 0);
+    while (true) {
+        Job job;
+        vector<pair<string, double>> values;
+        for (size_t k = 0; k < keys.size (); k++) {
+            const string &key = keys[k].first;
+            double value = keys[k].second[indices[k]];
+            values.push_back ({key, value});
+            if (key == "program")
+                job.program = (int) value;
+            else if (key == "note")
+                job.note = (int) value;
+            else if (key == "velocity")
+                job.velocity = (int) value;
+            else if (key == "hold")
+                job.hold = value;
+            else if (key == "tail")
+                job.tail = value;
+            else if (key == "rate")
+                job.rate = value;
+            else if (key == "internal_rate")
+                job.internal_rate = value;
+            else
+                for (int i = 0; i < defaults.length (); i++)
+                    if (key == parameter_key (array[i].name))
+                        job.params.push_back ({i, (float) value});
+        }
+        if (job.program < 0 || job.program > 127 || job.note < 0 || job.note > 127 ||
+            job.velocity < 1 || job.velocity > 127 || job.rate <= 0)
+            exit_error ("Line " + to_string (line) + ": program, note or velocity out of range or rate not positive");
+        job.output = fill_template (output, values, line);
+        jobs.push_back (job);
+
+        size_t k = keys.size ();
+        while (k > 0 && ++indices[k - 1] == keys[k - 1].second.size ())
+            indices[--k] = 0;
+        if (k == 0)
+            break;
+    }
+}
+
+void read_manifest (const char *path) {
+    ifstream file (path);
+    if (!file)
+        exit_error (string ("Could not read manifest ") + path);
+    string text;
+    int line = 0;
+    while (getline (file, text)) {
+        line++;
+        size_t comment = text.find ('#');
+        if (comment != string::npos)
+            text.erase (comment);
+        istringstream fields (text);
+        string kind;
+        if (!(fields >> kind))
+            continue;
+        if (kind == "shape")
+            read_shape (fields, line);
+        else if (kind == "render")
+            read_render (fields, line);
+        else
+            exit_error ("Line " + to_string (line) + ": expected shape or render but got " + kind);
+    }
+}
+
+// render a job with an instance that may have rendered others before
+// returns false if the output couldn't be created
+bool render (Nanceloid &synth, float *buffer, const Job &job, SampleFormat format) {
+    // rates first since changing them restarts the voice
+    synth.set_internal_rate (job.internal_rate);
+    synth.set_rate (job.rate);
+    synth.reset ();
+    for (const pair<int, TractShape> &shape : shapes) {
+        synth.set_shape_id (shape.first);
+        synth.get_shape () = shape.second;
+    }
+    synth.set_shape_id (job.program);
+    Parameter *array = synth.params.as_array ();
+    for (const pair<int, float> &param : job.params)
+        array[param.first].value = param.second;
+
+    WavWriter wav;
+    if (!wav.open (job.output.c_str (), job.rate, 2, format))
+        return false;
+
+    long off = (long) round (fmax (0, job.hold) * job.rate);
+    long total = off + (long) round (fmax (0, job.tail) * job.rate);
+    uint8_t on[] = {0x90, (uint8_t) job.note, (uint8_t) job.velocity};
+    synth.midi (on);
+    long frame = 0;
+    while (frame < total) {
+        if (frame == off) {
+            uint8_t note_off[] = {0x80, (uint8_t) job.note, 0};
+            synth.midi (note_off);
+        }
+        long until = frame < off ? off : total;
+        int frames = (int) min ((long) block_size, until - frame);
+        synth.run_interleaved (buffer, frames);
+        wav.write (buffer, frames);
+        frame += frames;
+    }
+    return true;
+}
+
+int main (int argc, char **argv) {
+    // default cli args
+    int threads = 0;
+    SampleFormat format = SAMPLE_INT16;
+
+    // parse cli args
+    int c;
+    while ((c = getopt (argc, argv, "j:f:")) != -1) {
+        switch (c) {
+            case 'j':
+                threads = atoi (optarg);
+                break;
+            case 'f':
+                if (!parse_sample_format (optarg, format))
+                    print_usage_and_exit (argv[0]);
+                break;
+            default:
+                print_usage_and_exit (argv[0]);
+        }
+    }
+    if (argc - optind != 1)
+        print_usage_and_exit (argv[0]);
+    read_manifest (argv[optind]);
+
+    // every thread keeps one synth and buffer for all of its jobs
+    ThreadPool pool (threads);
+    vector<Nanceloid *> synths (pool.size (), nullptr);
+    vector<float *> buffers (pool.size (), nullptr);
+    atomic<int> failures {0};
+    mutex error_mutex;
+    double seconds = 0;
+    auto start = chrono::steady_clock::now ();
+    for (const Job &job : jobs) {
+        seconds += fmax (0, job.hold) + fmax (0, job.tail);
+        pool.submit ([&] (int id) {
+            if (synths[id] == nullptr) {
+                synths[id] = new Nanceloid ();
+                buffers[id] = new float[block_size * 2];
+            }
+            if (!render (*synths[id], buffers[id], job, format)) {
+                lock_guard<mutex> lock (error_mutex);
+                cerr << "Could not create WAV file " << job.output << endl;
+                failures++;
+            }
+        });
+    }
+    pool.wait ();
+    double elapsed = chrono::duration<double> (chrono::steady_clock::now () - start).count ();
+
+    // report how much faster than realtime it was
+    cerr << "Rendered " << jobs.size () - failures << " files, " << seconds << "s in " << elapsed << "s on "
+         << pool.size () << " threads (" << seconds / fmax (elapsed, 1e-9) << "x realtime)" << endl;
+
+    for (int i = 0; i < pool.size (); i++) {
+        delete synths[i];
+        delete[] buffers[i];
+    }
+    return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
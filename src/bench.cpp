@@ -0,0 +1,181 @@
+#include <iostream>
+#include <cstdio>
+#include <cstdlib>
+#include <cmath>
+#include <chrono>
+#include <vector>
+#include <unistd.h>
+#include <nanceloid.h>
+
+using namespace std;
+
+// how long each measurement runs and how many times, keeping the fastest
+double min_time = 0.02;
+int repetitions = 3;
+
+const double rates[] = {44100, 48000, 96000, 192000};
+const double tract_lengths[] = {8, 16, 24};
+const double nose_admittances[] = {0, 0.25, 1};
+
+// call a function that does ops operations until min_time has passed and repeat
+// returns the fastest nanoseconds per operation
+template <typename F>
+double measure (F f, int ops) {
+    double best = INFINITY;
+    for (int r = 0; r < repetitions; r++) {
+        long calls = 0;
+        auto start = chrono::steady_clock::now ();
+        double elapsed;
+        do {
+            f ();
+            calls++;
+            elapsed = chrono::duration<double> (chrono::steady_clock::now () - start).count ();
+        } while (elapsed < min_time);
+        best = fmin (best, elapsed * 1e9 / (calls * ops));
+    }
+    return best;
+}
+
+// benchmarks reach into the synth like the choir does
+class Bench {
+    private:
+        Nanceloid synth;
+        double rate;
+        double tract_length;
+        double nose_admittance;
+        bool first = true;
+
+        void print (const char *name, double ns, bool realtime = false) {
+            printf ("%s\n    {\"benchmark\": \"%s\", \"rate\": %g, \"tract_length\": %g, \"nose_admittance\": %g, \"ns_per_op\": %.3f",
+                    first ? "" : ",", name, rate, tract_length, nose_admittance, ns);
+            if (realtime)
+                printf (", \"realtime_factor\": %.3f", 1e9 / rate / ns);
+            printf ("}");
+            first = false;
+        }
+
+    public:
+        // set up a synth playing a note through an open nose
+        Bench (double rate, double tract_length, double nose_admittance, bool first)
+            : rate (rate), tract_length (tract_length), nose_admittance (nose_admittance), first (first) {
+            // 2 different shapes to crossfade between
+            for (int id = 0; id < 2; id++) {
+                synth.set_shape_id (id);
+                TractShape &shape = synth.get_shape ();
+                for (int i = 0; i < TractShape::length; i++)
+                    shape.set_sample ((double) i / TractShape::length, 0.3 + 0.4 * fabs (sin (i * 0.3 + id)));
+                shape.velic_closure = 0;
+            }
+            synth.set_shape_id (0);
+            synth.params.tract_length.value = tract_length;
+            synth.params.nose_admittance.value = nose_admittance;
+            synth.set_rate (rate);
+            uint8_t on[] = {0x90, 60, 100};
+            synth.midi (on);
+
+            // settle into the note so every measurement starts from a sounding voice
+            float out[512];
+            for (int i = 0; i < rate / 256; i++)
+                synth.run_interleaved (out, 256);
+        }
+
+        void run () {
+            // whole blocks of output like a host would ask for
+            const int frames = 256;
+            float out[frames * 2];
+            print ("run", measure ([&] { synth.run_interleaved (out, frames); }, frames), true);
+
+            // control rate work with and without auto correlating the scope
+            synth.set_pitch_detection (PITCH_BATCH);
+            print ("run_control", measure ([&] { synth.run_control (); }, 1));
+            synth.set_pitch_detection (PITCH_STREAMING);
+            print ("run_control_no_pitch", measure ([&] { synth.run_control (); }, 1));
+            synth.set_pitch_detection (PITCH_BATCH);
+
+            // reflections when nothing moved and when every segment did
+            print ("update_reflections_steady", measure ([&] { synth.update_reflections (); }, 1));
+            print ("update_reflections_full", measure ([&] {
+                synth.shape.mark_changed ();
+                synth.update_reflections ();
+            }, 1));
+
+            // crossfading toward alternate shapes so the tract never settles
+            int id = 0;
+            print ("crossfade", measure ([&] {
+                synth.set_shape_id (id ^= 1);
+                synth.crossfade_shape ();
+            }, 1));
+            synth.set_shape_id (0);
+
+            // a note on and off then a controller that has to be matched against every parameter
+            uint8_t on[] = {0x90, 64, 100};
+            uint8_t off[] = {0x80, 64, 0};
+            uint8_t cc[] = {0xb0, 1, 64};
+            print ("midi", measure ([&] {
+                synth.midi (on);
+                synth.midi (off);
+                synth.midi (cc);
+            }, 3));
+        }
+};
+
+void print_usage_and_exit (char *command) {
+    cerr << "Usage: " << command << " [-t seconds] [-r repetitions]\n\n";
+    cerr << "-t seconds\n\tSpecify the minimum time each measurement runs for.\n\tIf left unspecified it is " << min_time << ".\n\n";
+    cerr << "-r repetitions\n\tSpecify how many times each measurement is repeated keeping the fastest.\n\tIf left unspecified it is " << repetitions << ".\n\n";
+    cerr << flush;
+    exit (EXIT_FAILURE);
+}
+
+int main (int argc, char **argv) {
+    int c;
+    while ((c = getopt (argc, argv, "t:r:")) != -1) {
+        switch (c) {
+            case 't':
+                min_time = atof (optarg);
+                break;
+            case 'r':
+                repetitions = atoi (optarg);
+                break;
+            default:
+                print_usage_and_exit (argv[0]);
+        }
+    }
+
+    // describe the build so results from different builds can be told apart
+#ifdef SINGLE_PRECISION
+    const char *precision = "single";
+#else
+    const char *precision = "double";
+#endif
+#if defined (__AVX__)
+    const char *simd = "avx";
+#elif defined (__SSE2__)
+    const char *simd = "sse2";
+#else
+    const char *simd = "none";
+#endif
+    printf ("{\n  \"build\": {\"compiler\": \"%s\", \"precision\": \"%s\", \"simd\": \"%s\", \"optimized\": %s},\n",
+            __VERSION__, precision, simd,
+#ifdef __OPTIMIZE__
+            "true"
+#else
+            "false"
+#endif
+            );
+    printf ("  \"results\": [");
+    bool first = true;
+    for (double rate : rates) {
+        for (double tract_length : tract_lengths) {
+            for (double nose_admittance : nose_admittances) {
+                Bench *bench = new Bench (rate, tract_length, nose_admittance, first);
+                bench->run ();
+                delete bench;
+                first = false;
+                fflush (stdout);
+            }
+        }
+    }
+    printf ("\n  ]\n}\n");
+    return 0;
+}
@@ -0,0 +1,132 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <iostream>
+#include <iomanip>
+#include <cmath>
+#include <algorithm>
+
+// how long the audio callback takes against its deadline, the time the period it renders lasts
+// written only by the audio thread and read from any other without locks
+class CallbackStats {
+    public:
+        static const int bins = 41;                 // 5% of the deadline each and the last one for 200% or more
+        static constexpr double bin_width = 0.05;
+
+        // the slowest call so far
+        struct Worst {
+            double duration;    // seconds
+            double deadline;    // seconds
+            long call;          // which call it was counting from 0
+            long first_tick;    // first control tick it ran
+            int ticks;          // control ticks it ran
+        };
+
+    private:
+        std::atomic<uint32_t> histogram[bins];
+        std::atomic<long> calls {0};
+        std::atomic<long> misses {0};
+        std::atomic<double> total_load {0};
+        // the worst call is written between 2 increments of a sequence number
+        // so readers retry while it is odd or if it changed while they read
+        std::atomic<uint32_t> worst_sequence {0};
+        std::atomic<double> worst_duration {0};
+        std::atomic<double> worst_deadline {1};
+        std::atomic<long> worst_call {0};
+        std::atomic<long> worst_first_tick {0};
+        std::atomic<int> worst_ticks {0};
+        double worst_load = 0;  // only used by the audio thread
+
+        // only the audio thread writes so counters don't need a read modify write
+        template <typename T, typename U>
+        static void add (std::atomic<T> &value, U amount) {
+            value.store (value.load (std::memory_order_relaxed) + amount, std::memory_order_relaxed);
+        }
+
+    public:
+        CallbackStats () {
+            for (std::atomic<uint32_t> &bin : histogram)
+                bin.store (0);
+        }
+
+        // record a call from the audio thread with the control ticks it ran
+        void record (double duration, double deadline, long first_tick, int ticks) {
+            double load = duration / deadline;
+            add (histogram[std::min (bins - 1, (int) (load / bin_width))], 1);
+            if (duration > deadline)
+                add (misses, 1);
+            add (total_load, load);
+            long call = calls.load (std::memory_order_relaxed);
+            if (load > worst_load) {
+                worst_load = load;
+                uint32_t sequence = worst_sequence.load (std::memory_order_relaxed);
+                worst_sequence.store (sequence + 1, std::memory_order_relaxed);
+                std::atomic_thread_fence (std::memory_order_release);
+                worst_duration.store (duration, std::memory_order_relaxed);
+                worst_deadline.store (deadline, std::memory_order_relaxed);
+                worst_call.store (call, std::memory_order_relaxed);
+                worst_first_tick.store (first_tick, std::memory_order_relaxed);
+                worst_ticks.store (ticks, std::memory_order_relaxed);
+                worst_sequence.store (sequence + 2, std::memory_order_release);
+            }
+            calls.store (call + 1, std::memory_order_release);
+        }
+
+        // get the number of calls so far
+        long get_calls () {
+            return calls.load (std::memory_order_acquire);
+        }
+
+        // get the number of calls that took longer than their deadline
+        long get_misses () {
+            return misses.load (std::memory_order_relaxed);
+        }
+
+        // get the average fraction of the deadline calls took
+        double get_mean_load () {
+            long n = get_calls ();
+            return n ? total_load.load (std::memory_order_relaxed) / n : 0;
+        }
+
+        // get the number of calls that fell in a bin of the histogram
+        uint32_t get_bin (int bin) {
+            return histogram[bin].load (std::memory_order_relaxed);
+        }
+
+        // get the slowest call so far
+        Worst get_worst () {
+            while (true) {
+                uint32_t before = worst_sequence.load (std::memory_order_acquire);
+                Worst worst = {
+                    worst_duration.load (std::memory_order_relaxed),
+                    worst_deadline.load (std::memory_order_relaxed),
+                    worst_call.load (std::memory_order_relaxed),
+                    worst_first_tick.load (std::memory_order_relaxed),
+                    worst_ticks.load (std::memory_order_relaxed),
+                };
+                std::atomic_thread_fence (std::memory_order_acquire);
+                if (!(before & 1) && worst_sequence.load (std::memory_order_relaxed) == before)
+                    return worst;
+            }
+        }
+
+        // display everything including the histogram
+        void print () {
+            Worst worst = get_worst ();
+            std::cout << "[callback]\n";
+            std::cout << "calls " << get_calls () << ", deadline misses " << get_misses ()
+                      << ", mean load " << std::fixed << std::setprecision (1) << get_mean_load () * 100 << "%\n";
+            std::cout << "worst " << std::setprecision (3) << worst.duration * 1000 << "ms of " << worst.deadline * 1000
+                      << "ms at call " << worst.call << " with " << worst.ticks << " control ticks from #" << worst.first_tick << "\n";
+            std::cout << "  [load] [calls]\n";
+            for (int i = 0; i < bins; i++) {
+                uint32_t count = get_bin (i);
+                if (count == 0)
+                    continue;
+                std::cout << std::setw (5) << std::right << (int) round (i * bin_width * 100) << (i == bins - 1 ? "%+ " : "%  ")
+                          << count << "\n";
+            }
+            std::cout << std::defaultfloat << std::setprecision (6) << std::flush;
+        }
+};
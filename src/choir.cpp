@@ -0,0 +1,498 @@
+#include <choir.h>
+#include <cmath>
+#include <algorithm>
+
+using namespace std;
+
+// clamp every lane to the range the waveguides are allowed to reach
+static inline void clip (lane &value) {
+    const lane low = lane {} - 5.0;
+    const lane high = lane {} + 5.0;
+    value = value < low ? low : value;
+    value = value > high ? high : value;
+}
+
+// clamp every lane to be at least 0
+static inline void clip_positive (lane &value) {
+    const lane zero = {};
+    value = value < zero ? zero : value;
+}
+
+// kelly lochbaum scattering of every lane at the junctions in [begin, end) done in place like scatter
+static inline void scatter_lanes (lane *r, lane *l, const lane *r_junction, const lane *l_junction,
+                                  int begin, int end, double refl_c) {
+    // r[j + 1] is overwritten before the next junction reads it so its old value is carried along
+    lane r_old = r[begin];
+    for (int j = begin; j < end; j++) {
+        lane r_next = r[j + 1];
+        lane r_refl = r_old * r_junction[j];
+        lane l_refl = l[j + 1] * l_junction[j + 1];
+        lane r_out = r_old - r_refl + l_refl * refl_c;
+        lane l_out = l[j + 1] - l_refl + r_refl * refl_c;
+        clip (r_out);
+        clip (l_out);
+        r[j + 1] = r_out;
+        l[j] = l_out;
+        r_old = r_next;
+    }
+}
+
+// the impedance of a segment in every lane given its diameters
+static inline void impedance (lane &z, const lane &diameter, double epsilon) {
+    lane radius = diameter / 2;
+    lane area = radius * radius * M_PI;
+    z = 1 / (area + epsilon);
+}
+
+Choir::Choir (Nanceloid &synth, int voices) : synth (synth) {
+    group_count = (voices + CHOIR_LANES - 1) / CHOIR_LANES;
+    voice_count = group_count * CHOIR_LANES;
+    this->voices = new Voice[voice_count];
+    groups = new Group[group_count];
+    r_delays = new SegmentDelay<lane>[group_count];
+    l_delays = new SegmentDelay<lane>[group_count];
+}
+
+Choir::~Choir () {
+    free ();
+    delete[] voices;
+    delete[] groups;
+    delete[] r_delays;
+    delete[] l_delays;
+}
+
+void Choir::free () {
+    for (int g = 0; g < group_count; g++) {
+        Group &group = groups[g];
+        delete[] group.r;
+        delete[] group.l;
+        delete[] group.r_junction;
+        delete[] group.l_junction;
+        delete[] group.nr;
+        delete[] group.nl;
+        group = Group ();
+    }
+    delete[] output;
+    delete[] scopes;
+    delete[] window;
+    output = nullptr;
+    scopes = nullptr;
+    window = nullptr;
+}
+
+void Choir::init () {
+    // free old waveguides
+    free ();
+
+    // same dimensions as the synth so the tract length can change too
+    int waveguide_length = synth.max_waveguide_length;
+    int nose_length = synth.max_nose_length;
+    for (int g = 0; g < group_count; g++) {
+        Group &group = groups[g];
+        group.r = new lane[waveguide_length];
+        group.l = new lane[waveguide_length];
+        group.r_junction = new lane[waveguide_length];
+        group.l_junction = new lane[waveguide_length];
+        group.nr = new lane[nose_length];
+        group.nl = new lane[nose_length];
+        r_delays[g].init (waveguide_length, synth.max_segment_delay);
+        l_delays[g].init (waveguide_length, synth.max_segment_delay);
+    }
+
+    // a block is never longer than a control period
+    output = new double[synth.control_rate_divider];
+
+    // scopes for pitch detection
+    scope_size = synth.scope_size;
+    scopes = new lane[scope_size * group_count];
+    window = new double[scope_size];
+    pitch_detector.init (scope_size);
+
+    clear ();
+}
+
+void Choir::reset () {
+    for (int i = 0; i < voice_count; i++)
+        voices[i] = Voice ();
+    if (output)
+        clear ();
+}
+
+void Choir::clear () {
+    int waveguide_length = synth.max_waveguide_length;
+    int nose_length = synth.max_nose_length;
+    for (int g = 0; g < group_count; g++) {
+        Group &group = groups[g];
+        fill (group.r, group.r + waveguide_length, lane {});
+        fill (group.l, group.l + waveguide_length, lane {});
+        fill (group.r_junction, group.r_junction + waveguide_length, lane {});
+        fill (group.l_junction, group.l_junction + waveguide_length, lane {});
+        fill (group.nr, group.nr + nose_length, lane {});
+        fill (group.nl, group.nl + nose_length, lane {});
+        group.x = group.x2 = group.x3 = lane {};
+        group.v = group.v2 = group.v3 = lane {};
+        group.target_pressure = group.pressure = group.cord_tension = group.frequency = lane {};
+        r_delays[g].clear ();
+        l_delays[g].clear ();
+    }
+
+    tract_segments = nose_delay = nose_i = 0;
+    segment_delay = 1;
+    scope_i = 0;
+    pitch_tick = 0;
+    fill (scopes, scopes + scope_size * group_count, lane {});
+
+    run_control ();
+}
+
+void Choir::run_control () {
+    int waveguide_length = synth.waveguide_length;
+    int ui = synth.mouth_i + 1;
+
+    // follow the segments of the synth the same way Nanceloid::resize does
+    bool resized = waveguide_length != tract_segments;
+    bool was_fractional = segment_delay > 1;
+    bool fractional = synth.segment_delay > 1;
+    for (int g = 0; g < group_count; g++) {
+        Group &group = groups[g];
+        if (waveguide_length != tract_segments && (fractional || was_fractional)) {
+            // segments of a different size can't carry on from the old waves
+            for (int i = 0; i < synth.max_waveguide_length; i++)
+                group.r[i] = group.l[i] = lane {};
+        } else {
+            // silence whatever falls off the end when the tract gets shorter
+            for (int i = waveguide_length; i < tract_segments; i++)
+                group.r[i] = group.l[i] = lane {};
+        }
+        if (fractional && (waveguide_length != tract_segments || !was_fractional)) {
+            r_delays[g].reset (group.r, waveguide_length);
+            l_delays[g].reset (group.l, waveguide_length);
+        }
+        if (fractional) {
+            r_delays[g].set_delay (synth.segment_delay);
+            l_delays[g].set_delay (synth.segment_delay);
+        }
+        if (synth.nose_delay != nose_delay)
+            resize_delay (group.nr, group.nl, nose_i, nose_delay, synth.nose_delay);
+    }
+    if (synth.nose_delay != nose_delay)
+        nose_i = 0;
+    tract_segments = waveguide_length;
+    nose_delay = synth.nose_delay;
+    segment_delay = synth.segment_delay;
+
+    // the shared shape around the folds and uvula
+    second_fold_diameter = synth.diameter[1];
+    uvula_diameter = synth.diameter[ui];
+    z2 = synth.impedance[2];
+    zu1 = synth.impedance[ui + 1];
+
+    // every voice starts with the reflections of the shared shape
+    // which only need copying where the synth changed them
+    // the junctions at the folds and uvula are rewritten by each voice every sample anyway
+    int begin = resized ? 0 : synth.reflections_begin;
+    int end = resized ? waveguide_length : synth.reflections_end;
+    for (int g = 0; g < group_count; g++) {
+        Group &group = groups[g];
+        for (int i = begin; i < end; i++) {
+            group.r_junction[i] = lane {} + synth.r_junction[i];
+            group.l_junction[i] = lane {} + synth.l_junction[i];
+        }
+        group.r_junction[waveguide_length - 1] = lane {} + synth.r_junction[waveguide_length - 1];
+        group.l_junction[0] = lane {} + synth.l_junction[0];
+    }
+
+    // per voice envelopes and pitch
+    if (++pitch_tick == pitch_stride)
+        pitch_tick = 0;
+    for (int k = 0; k < voice_count; k++) {
+        Voice &voice = voices[k];
+        Group &group = groups[k / CHOIR_LANES];
+        int lane_i = k % CHOIR_LANES;
+
+        // run adsr envelope to get current input pressure
+        double target_pressure = synth.get_envelope (voice.note);
+        group.target_pressure[lane_i] = target_pressure;
+
+        // pitch detection of the voices that are making sound
+        // always batch whatever the synth uses since every voice would need its own tracker or thread
+        // a voice keeps its last estimate on the ticks it isn't detected
+        bool sounding = target_pressure > 0 || group.pressure[lane_i] > synth.epsilon;
+        if (!sounding)
+            voice.detected_frequency = 0;
+        else if ((pitch_tick + k) % pitch_stride == 0) {
+            // gather the scope of this voice in time order
+            double level = 0;
+            int j = scope_i;
+            for (int i = 0; i < scope_size; i++) {
+                double s = scopes[j * group_count + k / CHOIR_LANES][lane_i];
+                window[i] = s;
+                if (s > level)
+                    level = s;
+                if (++j == scope_size)
+                    j = 0;
+            }
+            int period = pitch_detector.detect (window, 0);
+            voice.detected_frequency = synth.get_frequency_of_period (period, level);
+        }
+
+        // update target frequency
+        voice.frequency += (synth.get_target_frequency (voice.note) - voice.frequency) * synth.params.portamento.value;
+        group.frequency[lane_i] = voice.frequency;
+
+        // pitch correction
+        group.cord_tension[lane_i] = synth.correct_pitch (voice.frequency, voice.detected_frequency, voice.error);
+    }
+}
+
+const double *Choir::run (int frames) {
+    for (int i = 0; i < frames; i++)
+        output[i] = 0;
+    for (int g = 0; g < group_count; g++)
+        run_group (g, frames);
+    for (int i = 0; i < frames; i++)
+        synth.coupling.next ();
+    scope_i = (scope_i + frames) % scope_size;
+    nose_i = (nose_i + frames) % nose_delay;
+    return output;
+}
+
+void Choir::run_group (int group_i, int frames) {
+    Group &group = groups[group_i];
+
+    // the same glottal source and uvula model as Nanceloid::run_tract
+    const double amp = 0.1;
+    const double damping = 0.1;
+    const double uvula_tract_coupling = 0.5;
+    const double n = 10;
+    const double nd = 5;
+    const Nanceloid::Coefficients &c = synth.coefficients;
+    const double uvula = c.uvula;
+    const double fold_2_c = c.fold_2_c;
+    const double uvula_frequency = 100;
+    const double uvula_tension = c.uvula_tension;
+    const double weight = c.pressure_weight;
+    const double voicing = synth.voicing;
+    const double dt = synth.dt;
+    const double max_impedance = synth.max_impedance;
+    const double epsilon = synth.epsilon;
+    const lane one = lane {} + 1.0;
+
+    // waveguide dimensions and junction
+    const int waveguide_length = synth.waveguide_length;
+    const int end = waveguide_length - 1;
+    const int throat_i = synth.throat_i;
+    const int mouth_i = synth.mouth_i;
+    const int ui = mouth_i + 1;
+    const double refl_c = c.refl_c;
+    const double refl_right = c.refl_right;
+    const double mouth_radiance = 1 - refl_right;
+    const double nose_radiance = c.nose_radiance;
+
+    // keep the state local while running
+    lane *const r = group.r;
+    lane *const l = group.l;
+    lane *const nr = group.nr;
+    lane *const nl = group.nl;
+    lane *r_junction = group.r_junction;
+    lane *l_junction = group.l_junction;
+    lane x = group.x;
+    lane x2 = group.x2;
+    lane x3 = group.x3;
+    lane v = group.v;
+    lane v2 = group.v2;
+    lane v3 = group.v3;
+    lane pressure = group.pressure;
+    const lane target_pressure = group.target_pressure;
+    const lane cord_tension = group.cord_tension;
+    const lane frequency = group.frequency;
+    const lane fold_coupling_k = cord_tension / 2;
+    // every group follows the same ramp which the synth advances after the block
+    Ramp coupling_ramp = synth.coupling;
+
+    int row = scope_i;
+    int nose_pos = nose_i;
+    SegmentDelay<lane> &r_delay = r_delays[group_i];
+    SegmentDelay<lane> &l_delay = l_delays[group_i];
+    const bool fractional = segment_delay > 1;
+    for (int i = 0; i < frames; i++) {
+        // segments longer than a sample deliver the waves that left their junctions a while ago
+        if (fractional) {
+            r_delay.read (r, waveguide_length);
+            l_delay.read (l, waveguide_length);
+        }
+
+        // cheap filter to smooth pops
+        pressure = (target_pressure * weight + pressure) / (1 + weight);
+
+        // glottal source and uvula
+        const double coupling = coupling_ramp.next ();
+        lane coupling_spring = fold_coupling_k * (x2 - x);
+        // first fold
+        lane delta_pressure = pressure + l[0] * coupling;
+        lane a = -cord_tension * (x + n * x * x * x) - damping * (v + nd * v * x * x) * frequency + delta_pressure * amp * cord_tension * (1 + n) + coupling_spring;
+        // second fold
+        lane delta_pressure2 = (r[0] + l[1]) * coupling;
+        lane a2 = -cord_tension * (x2 + n * x2 * x2 * x2) - damping * (v2 + nd * v2 * x2 * x2) * frequency + delta_pressure2 * amp * cord_tension * (1 + n) - coupling_spring;
+        // uvula
+        lane delta_pressure3 = (r[ui] + l[ui + 1]) * uvula_tract_coupling;
+        lane a3 = -uvula_tension * (x3 + n * x3 * x3 * x3) - damping * (v3 + nd * v3 * x3 * x3) * uvula_frequency + delta_pressure3 * amp * uvula_tension * (1 + n);
+        // integrate
+        v  += a  * dt;
+        v2 += a2 * dt;
+        v3 += a3 * dt;
+        x  += v  * dt;
+        x2 += v2 * dt;
+        x3 += v3 * dt;
+
+        // update the diameters of the fold and uvula segments of each voice
+        lane d0 = x;
+        lane d1 = (second_fold_diameter + x2 * fold_2_c) / (1 + fold_2_c);
+        lane du = uvula_diameter + x3 * uvula;
+        clip_positive (d0);
+        clip_positive (d1);
+        clip_positive (du);
+        // update reflection coefficients
+        lane z0, z1, zu0;
+        impedance (z0, d0, epsilon);
+        impedance (z1, d1, epsilon);
+        impedance (zu0, du, epsilon);
+        r_junction[0] = z1 > max_impedance ? one : (z1 - z0) / (z1 + z0);
+        l_junction[1] = z0 > max_impedance ? one : (z0 - z1) / (z0 + z1);
+        r_junction[1] = z2 > max_impedance ? one : (z2 - z1) / (z2 + z1);
+        l_junction[2] = z1 > max_impedance ? one : (z1 - z2) / (z1 + z2);
+        r_junction[ui]     = zu1 > max_impedance ? one : (zu1 - zu0) / (zu1 + zu0);
+        l_junction[ui + 1] = zu0 > max_impedance ? one : (zu0 - zu1) / (zu0 + zu1);
+        // glottal output
+        lane disp = x + 1 - voicing;
+        lane glottal_output = pressure * disp * disp * M_PI;
+
+        // updated in place like Nanceloid::run_tract so the ends and junction are worked out first
+        // ends of waveguide
+        lane r_start = l[0] * l_junction[0] + glottal_output;
+        lane l_end = r[end] * r_junction[end];
+        lane nl_end = nr[nose_pos];
+        clip (nl_end);
+        nl_end *= refl_right;
+
+        // nose throat mouth junction
+        lane throat_out = r[throat_i];
+        lane mouth_out = l[mouth_i];
+        lane nose_out = nl[nose_pos];
+        clip (nose_out);
+        lane throat_refl = synth.throat_refl_c * throat_out;
+        lane mouth_refl = synth.mouth_refl_c * mouth_out;
+        lane nose_refl = synth.nose_refl_c * nose_out;
+        lane throat_trans = throat_out - throat_refl;
+        lane mouth_trans = mouth_out - mouth_refl;
+        lane nose_trans = nose_out - nose_refl;
+        lane throat_in = synth.mouth_to_throat_w * mouth_trans + synth.nose_to_throat_w * nose_trans + throat_refl * refl_c;
+        lane mouth_in = synth.throat_to_mouth_w * throat_trans + synth.nose_to_mouth_w * nose_trans + mouth_refl * refl_c;
+        lane nose_in = synth.throat_to_nose_w * throat_trans + synth.mouth_to_nose_w * mouth_trans + nose_refl * refl_c;
+
+        // update mouth and throat
+        // either side of the nose throat mouth junction since it was handled up there
+        scatter_lanes (r, l, r_junction, l_junction, 0, throat_i, refl_c);
+        scatter_lanes (r, l, r_junction, l_junction, mouth_i, waveguide_length - 1, refl_c);
+
+        // now the new waves can go in
+        r[0] = r_start;
+        l[end] = l_end;
+        l[throat_i] = throat_in;
+        r[mouth_i] = mouth_in;
+        if (fractional) {
+            r_delay.write (r, waveguide_length);
+            l_delay.write (l, waveguide_length);
+        }
+        nl[nose_pos] = nl_end;
+        nr[nose_pos] = nose_in;
+        if (++nose_pos == nose_delay)
+            nose_pos = 0;
+
+        // accumulate sound output from right end of waveguide
+        lane nose_output = nr[nose_pos];
+        clip (nose_output);
+        lane voice_output = r[end] * mouth_radiance + nose_output * nose_radiance;
+        scopes[row * group_count + group_i] = voice_output;
+        if (++row == scope_size)
+            row = 0;
+        double mix = 0;
+        for (int k = 0; k < CHOIR_LANES; k++)
+            mix += voice_output[k];
+        output[i] += mix;
+    }
+
+    // save the state
+    group.x = x;
+    group.x2 = x2;
+    group.x3 = x3;
+    group.v = v;
+    group.v2 = v2;
+    group.v3 = v3;
+    group.pressure = pressure;
+}
+
+void Choir::note_on (int note, double velocity) {
+    // retrigger a voice already holding this note
+    // otherwise prefer a silent voice, then the oldest released one, then steal the oldest held one
+    int chosen = 0;
+    int chosen_rank = -1;
+    int chosen_time = 0;
+    for (int k = 0; k < voice_count; k++) {
+        Nanceloid::Note &n = voices[k].note;
+        double pressure = groups[k / CHOIR_LANES].target_pressure[k % CHOIR_LANES];
+        int rank;
+        int time;
+        if (n.on && n.note == note) {
+            chosen = k;
+            break;
+        } else if (!n.on && pressure == 0) {
+            rank = 3;
+            time = n.off_time;
+        } else if (!n.on) {
+            rank = 2;
+            time = n.off_time;
+        } else {
+            rank = 1;
+            time = n.on_time;
+        }
+        if (rank > chosen_rank || (rank == chosen_rank && time < chosen_time)) {
+            chosen = k;
+            chosen_rank = rank;
+            chosen_time = time;
+        }
+    }
+
+    // a stolen voice waits for its next detection instead of correcting toward the old note
+    Nanceloid::Note &n = voices[chosen].note;
+    if (n.note != note)
+        voices[chosen].detected_frequency = 0;
+    n.note = note;
+    n.velocity = velocity;
+    n.on_time = synth.clock;
+    n.on = true;
+    n.start_pressure = groups[chosen / CHOIR_LANES].target_pressure[chosen % CHOIR_LANES];
+}
+
+void Choir::note_off (int note) {
+    for (int k = 0; k < voice_count; k++) {
+        Nanceloid::Note &n = voices[k].note;
+        if (n.on && n.note == note) {
+            n.off_time = synth.clock;
+            n.on = false;
+        }
+    }
+}
+
+int Choir::playing_note () {
+    int note = -1;
+    int time = 0;
+    for (int k = 0; k < voice_count; k++) {
+        Nanceloid::Note &n = voices[k].note;
+        if (n.on && (note == -1 || n.on_time > time)) {
+            note = n.note;
+            time = n.on_time;
+        }
+    }
+    return note;
+}
@@ -0,0 +1,118 @@
+#pragma once
+
+#include <nanceloid.h>
+#include <pitch.h>
+
+// number of voices processed together, one per simd lane
+#ifndef CHOIR_LANES
+#define CHOIR_LANES 4
+#endif
+
+// a value for each voice in a group
+typedef double lane __attribute__ ((vector_size (CHOIR_LANES * sizeof (double))));
+
+// polyphonic voices sharing the parameters, tract shape and lfos of a synth
+// voices are simulated in groups with every per voice value stored as a lane
+// so each step of the waveguide processes a whole group at once
+class Choir {
+    private:
+        // a voice that can be given a note
+        struct Voice {
+            Nanceloid::Note note;           // note played by this voice
+            double frequency = 0;           // current intended playing frequency
+            double detected_frequency = 0;  // current detected frequency
+            double error = 0;               // frequency error
+        };
+
+        // the waveguides and masses of a group of voices, one voice per lane
+        struct Group {
+            // right and left going
+            lane *r = nullptr;
+            lane *l = nullptr;
+            // reflection coefficients at each junction
+            lane *r_junction = nullptr;
+            lane *l_junction = nullptr;
+            // right and left going for the nose as rings like Nanceloid::nr and nl
+            lane *nr = nullptr;
+            lane *nl = nullptr;
+            // the masses used for folds etc
+            lane x = {};
+            lane x2 = {};
+            lane x3 = {};
+            lane v = {};
+            lane v2 = {};
+            lane v3 = {};
+            // control rate values
+            lane target_pressure = {};
+            lane pressure = {};
+            lane cord_tension = {};
+            lane frequency = {};
+        };
+
+        Nanceloid &synth;
+        int voice_count;
+        int group_count;
+        Voice *voices;
+        Group *groups;
+        // the waves that left the junctions of each group when segments are longer than a sample
+        SegmentDelay<lane> *r_delays;
+        SegmentDelay<lane> *l_delays;
+        // dimensions as of the last control tick
+        int tract_segments = 0;
+        int nose_delay = 0;
+        double segment_delay = 1;
+        int nose_i = 0;                 // position in the nose rings of every group
+        double *output = nullptr;       // mixed output of a block
+        // per voice scopes for pitch detection, one row of every group per sample
+        lane *scopes = nullptr;
+        double *window = nullptr;       // one voice of the scopes in time order
+        int scope_size = 0;
+        int scope_i = 0;
+        PitchDetector pitch_detector;
+        // each voice is detected every few control ticks with the voices staggered across them
+        static const int pitch_stride = 2;
+        int pitch_tick = 0;
+        // tract values shared by all voices at the fold and uvula
+        double second_fold_diameter = 0;
+        double uvula_diameter = 0;
+        double z2 = 0;
+        double zu1 = 0;
+
+        // free the waveguides
+        void free ();
+
+        // silence the waveguides and scopes and follow the synth from scratch
+        void clear ();
+
+        // run a group of voices for a block of samples adding to the output
+        void run_group (int group_i, int frames);
+
+    public:
+        // the number of voices is rounded up to a whole number of groups
+        Choir (Nanceloid &synth, int voices);
+        ~Choir ();
+
+        // allocate the waveguides for the current rate of the synth
+        void init ();
+
+        // release every voice and silence the waveguides without reallocating them
+        void reset ();
+
+        // run per voice envelopes, pitch and reflections
+        // called at control rate after the synth updates the shared shape
+        void run_control ();
+
+        // run every voice for a block of up to one control period of samples
+        // returns the mixed output
+        const double *run (int frames);
+
+        // play a note on a free voice or steal one
+        void note_on (int note, double velocity);
+
+        // release every voice playing a note
+        void note_off (int note);
+
+        // returns the most recently played held note
+        // -1 for not playing
+        int playing_note ();
+};
@@ -0,0 +1,112 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+
+// formats samples are sent to devices and files in
+enum SampleFormat {
+    SAMPLE_INT16,       // 16 bit pcm
+    SAMPLE_INT24,       // 24 bit pcm packed into 3 little endian bytes
+    SAMPLE_FLOAT32,     // 32 bit float
+};
+
+// get a format from its name, 16, 24 or float
+// returns false if it isn't one
+static inline bool parse_sample_format (const char *name, SampleFormat &format) {
+    if (!strcmp (name, "16"))
+        format = SAMPLE_INT16;
+    else if (!strcmp (name, "24"))
+        format = SAMPLE_INT24;
+    else if (!strcmp (name, "float"))
+        format = SAMPLE_FLOAT32;
+    else
+        return false;
+    return true;
+}
+
+// bytes taken by a sample of a format
+static inline int get_sample_size (SampleFormat format) {
+    return format == SAMPLE_INT16 ? 2 : format == SAMPLE_INT24 ? 3 : 4;
+}
+
+// converts float samples from -1 to 1 to the other formats
+// the integer formats are clipped and get triangular dither of 1 lsb
+// float is copied as is since it can carry peaks past 1
+// samples are processed a vector at a time with a separate dither generator in each lane
+class SampleConverter {
+    private:
+        static const int width = 4;     // 16 byte vectors are native to sse2 and neon
+        typedef float floats __attribute__ ((vector_size (width * sizeof (float))));
+        typedef int32_t ints __attribute__ ((vector_size (width * sizeof (int32_t))));
+        typedef uint32_t uints __attribute__ ((vector_size (width * sizeof (uint32_t))));
+
+        uints dither_state;
+
+        // triangular noise from -1 to 1 in every lane
+        floats dither () {
+            // a linear congruential step then the difference of its 2 halves
+            dither_state = dither_state * 1664525u + 1013904223u;
+            ints high = (ints) (dither_state >> 16);
+            ints low = (ints) (dither_state & 0xffff);
+            return __builtin_convertvector (high - low, floats) * (1.0f / 65536);
+        }
+
+        // scale, dither and round a vector of samples to integers between -scale - 1 and scale
+        ints quantize (floats x, float scale) {
+            x = x * scale + dither ();
+            x = x < -scale - 1 ? -scale - 1 : x;
+            x = x > scale ? scale : x;
+            // converting truncates so round away from 0 first
+            x = x + (x < 0 ? -0.5f : 0.5f);
+            return __builtin_convertvector (x, ints);
+        }
+
+        // load up to a vector of samples padding with 0
+        static floats load (const float *in, int count) {
+            floats x = {};
+            memcpy (&x, in, count * sizeof (float));
+            return x;
+        }
+
+    public:
+        SampleConverter () {
+            for (int i = 0; i < width; i++)
+                dither_state[i] = 0x9e3779b9u * (i + 1);
+        }
+
+        void to_int16 (const float *in, int16_t *out, int count) {
+            for (int i = 0; i < count; i += width) {
+                int n = count - i < width ? count - i : width;
+                ints x = quantize (load (in + i, n), 32767);
+                for (int k = 0; k < n; k++)
+                    out[i + k] = x[k];
+            }
+        }
+
+        void to_int24 (const float *in, uint8_t *out, int count) {
+            for (int i = 0; i < count; i += width) {
+                int n = count - i < width ? count - i : width;
+                ints x = quantize (load (in + i, n), 8388607);
+                for (int k = 0; k < n; k++) {
+                    uint8_t *bytes = out + (i + k) * 3;
+                    bytes[0] = x[k];
+                    bytes[1] = x[k] >> 8;
+                    bytes[2] = x[k] >> 16;
+                }
+            }
+        }
+
+        void to_float32 (const float *in, float *out, int count) {
+            memcpy (out, in, count * sizeof (float));
+        }
+
+        // convert to any format writing get_sample_size bytes per sample
+        void convert (const float *in, void *out, int count, SampleFormat format) {
+            if (format == SAMPLE_INT16)
+                to_int16 (in, (int16_t *) out, count);
+            else if (format == SAMPLE_INT24)
+                to_int24 (in, (uint8_t *) out, count);
+            else
+                to_float32 (in, (float *) out, count);
+        }
+};
@@ -0,0 +1,124 @@
+#pragma once
+
+#include <algorithm>
+
+// a waveguide without junctions is a pure delay so it can be kept as a pair of rings
+// both are read and then written at the same position which moves along one each sample
+// forward holds the waves heading away from the start and backward the ones heading back to it
+// this changes the number of segments keeping the waves nearest the start
+// afterwards the position is 0
+template <typename T>
+static inline void resize_delay (T *forward, T *backward, int position, int length, int new_length) {
+    // put the oldest wave first
+    std::rotate (forward, forward + position, forward + length);
+    std::rotate (backward, backward + position, backward + length);
+    if (new_length < length) {
+        // the newest forward waves and the oldest backward ones are nearest the start
+        std::copy (forward + length - new_length, forward + length, forward);
+        std::fill (forward + new_length, forward + length, T {});
+        std::fill (backward + new_length, backward + length, T {});
+    } else {
+        // the new segments are at the far end and start silent
+        std::copy_backward (forward, forward + length, forward + new_length);
+        std::fill (forward, forward + new_length - length, T {});
+        std::fill (backward + length, backward + new_length, T {});
+    }
+}
+
+// the segments of a waveguide when each one is longer than a sample
+// the waves leaving the junctions are kept as one row per sample
+// and the waves arriving at the far ends of the segments are interpolated between rows
+template <typename T>
+class SegmentDelay {
+    private:
+        T *rows = nullptr;
+        int width = 0;              // max segments in a row
+        int row_count = 0;
+        int row_i = 0;              // next row to be written
+        int taps = 2;               // rows interpolated between
+        int first = 1;              // delay of the newest tap in samples
+        T coefficients[4] = {};
+
+        // the row written a given number of samples ago
+        const T *row (int delay) {
+            int i = row_i - delay;
+            if (i < 0)
+                i += row_count;
+            return rows + i * width;
+        }
+
+    public:
+        SegmentDelay () {}
+        SegmentDelay (const SegmentDelay &) = delete;
+        SegmentDelay &operator= (const SegmentDelay &) = delete;
+
+        ~SegmentDelay () {
+            delete[] rows;
+        }
+
+        // allocate for up to width segments delaying by up to max_delay samples
+        void init (int width, double max_delay) {
+            delete[] rows;
+            this->width = width;
+            row_count = (int) max_delay + 3;
+            rows = new T[row_count * width] ();
+            row_i = 0;
+        }
+
+        // set the delay of every segment in samples, at least 1
+        void set_delay (double delay) {
+            int whole = (int) delay;
+            if (whole < 2) {
+                // not enough rows for a centered lagrange so interpolate linearly between the newest 2
+                double x = delay - 1;
+                taps = 2;
+                first = 1;
+                coefficients[0] = T {} + (1 - x);
+                coefficients[1] = T {} + x;
+            } else {
+                // 3rd order lagrange with the delay between the middle 2 rows where it never gains
+                double x = delay - (whole - 1);
+                taps = 4;
+                first = whole - 1;
+                coefficients[0] = T {} + -(x - 1) * (x - 2) * (x - 3) / 6;
+                coefficients[1] = T {} + x * (x - 2) * (x - 3) / 2;
+                coefficients[2] = T {} + -x * (x - 1) * (x - 3) / 2;
+                coefficients[3] = T {} + x * (x - 1) * (x - 2) / 6;
+            }
+        }
+
+        // forget every wave so far
+        void clear () {
+            std::fill (rows, rows + row_count * width, T {});
+            row_i = 0;
+        }
+
+        // fill the history with a set of waves as if they had been leaving the junctions forever
+        void reset (const T *waves, int segments) {
+            for (int i = 0; i < row_count; i++)
+                std::copy (waves, waves + segments, rows + i * width);
+            row_i = 0;
+        }
+
+        // read the waves arriving at the far end of each segment
+        void read (T *waves, int segments) {
+            const T *a = row (first);
+            const T *b = row (first + 1);
+            if (taps == 2) {
+                for (int j = 0; j < segments; j++)
+                    waves[j] = a[j] * coefficients[0] + b[j] * coefficients[1];
+                return;
+            }
+            const T *c = row (first + 2);
+            const T *d = row (first + 3);
+            for (int j = 0; j < segments; j++)
+                waves[j] = a[j] * coefficients[0] + b[j] * coefficients[1] + c[j] * coefficients[2] + d[j] * coefficients[3];
+        }
+
+        // write the waves that just left the junctions
+        void write (const T *waves, int segments) {
+            std::copy (waves, waves + segments, rows + row_i * width);
+            if (++row_i == row_count)
+                row_i = 0;
+        }
+};
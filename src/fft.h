@@ -0,0 +1,86 @@
+#pragma once
+
+#include <complex>
+#include <cmath>
+
+// in place radix 2 fft with precomputed bit reversal and twiddle tables
+class FFT {
+    private:
+        int size = 0;
+        int *reversed = nullptr;                    // bit reversed index of each index
+        std::complex<double> *twiddles = nullptr;   // e^(-2 pi i k / size) for the first half
+
+        void free () {
+            delete[] reversed;
+            delete[] twiddles;
+            reversed = nullptr;
+            twiddles = nullptr;
+        }
+
+        void transform (std::complex<double> *data, bool inverse) {
+            // reorder into bit reversed order
+            for (int i = 0; i < size; i++) {
+                int j = reversed[i];
+                if (j > i)
+                    std::swap (data[i], data[j]);
+            }
+            // butterflies
+            for (int span = 1; span < size; span *= 2) {
+                int stride = size / (span * 2);
+                for (int i = 0; i < size; i += span * 2) {
+                    for (int j = 0; j < span; j++) {
+                        std::complex<double> w = twiddles[j * stride];
+                        if (inverse)
+                            w = std::conj (w);
+                        std::complex<double> a = data[i + j];
+                        std::complex<double> b = data[i + j + span] * w;
+                        data[i + j] = a + b;
+                        data[i + j + span] = a - b;
+                    }
+                }
+            }
+        }
+
+    public:
+        FFT () {}
+        FFT (const FFT &) = delete;
+        FFT &operator= (const FFT &) = delete;
+
+        ~FFT () {
+            free ();
+        }
+
+        // precalculate the tables for a given size which must be a power of 2
+        void plan (int size) {
+            free ();
+            this->size = size;
+            int bits = 0;
+            while ((1 << bits) < size)
+                bits++;
+            reversed = new int[size];
+            for (int i = 0; i < size; i++) {
+                int j = 0;
+                for (int b = 0; b < bits; b++)
+                    if (i & (1 << b))
+                        j |= 1 << (bits - 1 - b);
+                reversed[i] = j;
+            }
+            twiddles = new std::complex<double>[size / 2 + 1];
+            for (int k = 0; k < size / 2; k++)
+                twiddles[k] = std::polar (1.0, -2 * M_PI * k / size);
+        }
+
+        // the size of the transform
+        int get_size () {
+            return size;
+        }
+
+        void forward (std::complex<double> *data) {
+            transform (data, false);
+        }
+
+        // inverse transform, not normalized by the size
+        void inverse (std::complex<double> *data) {
+            transform (data, true);
+        }
+};
@@ -0,0 +1,277 @@
+#include <iostream>
+#include <string>
+#include <vector>
+#include <cstring>
+#include <cmath>
+#include <complex>
+#include <unistd.h>
+#include <nanceloid.h>
+#include <fft.h>
+#include <wav.h>
+
+using namespace std;
+
+// ways of comparing a render to its golden output
+enum Comparison {
+    COMPARE_EXACT,      // every sample identical
+    COMPARE_MAX_ABS,    // largest sample difference within the tolerance
+    COMPARE_SPECTRAL,   // log spectral distance in db within the tolerance
+};
+
+// a midi message at a time in seconds
+struct ScriptEvent {
+    double time;
+    uint8_t data[3];
+};
+
+// a fixed performance rendered the same way every time
+struct Scenario {
+    const char *name;
+    double rate;                    // output rate
+    double internal_rate;           // simulation rate, 0 for the output rate
+    int voices;
+    PitchDetection pitch_detection; // only batch or streaming are deterministic
+    double seconds;
+    void (*setup) (Nanceloid &synth);
+    vector<ScriptEvent> events;
+};
+
+// fill a saved shape with a smooth made up tract
+void make_shape (Nanceloid &synth, int id, double phase, double velic_closure) {
+    synth.set_shape_id (id);
+    TractShape &shape = synth.get_shape ();
+    for (int i = 0; i < TractShape::length; i++)
+        shape.set_sample ((double) i / TractShape::length, 0.25 + 0.5 * fabs (sin (i * 0.25 + phase)));
+    shape.velic_closure = velic_closure;
+    synth.set_shape_id (0);
+}
+
+const vector<Scenario> scenarios = {
+    // a plain held note with the default shapes
+    {"sustain", 44100, 0, 1, PITCH_BATCH, 0.5, [] (Nanceloid &synth) {}, {
+        {0.00, {0xc0, 'a', 0}},
+        {0.02, {0x90, 60, 100}},
+        {0.40, {0x80, 60, 0}},
+    }},
+    // pitch bend, controllers and a legato retrigger
+    {"expression", 44100, 0, 1, PITCH_STREAMING, 0.5, [] (Nanceloid &synth) {
+        synth.params.volume.map_cc (7);
+        synth.params.panning.map_cc (10);
+    }, {
+        {0.00, {0x90, 57, 90}},
+        {0.12, {0xe0, 0, 0x60}},
+        {0.20, {0xb0, 7, 80}},
+        {0.25, {0xb0, 10, 20}},
+        {0.30, {0x90, 64, 110}},
+        {0.42, {0x90, 64, 0}},
+    }},
+    // switching between shapes with an open nose at a different tract length
+    {"shapes", 44100, 0, 1, PITCH_BATCH, 0.5, [] (Nanceloid &synth) {
+        make_shape (synth, 1, 0, 1);
+        make_shape (synth, 2, 1.3, 0);
+        synth.params.tract_length.value = 14;
+    }, {
+        {0.00, {0xc0, 1, 0}},
+        {0.01, {0x90, 55, 100}},
+        {0.15, {0xc0, 2, 0}},
+        {0.30, {0xc0, 1, 0}},
+        {0.42, {0x80, 55, 0}},
+    }},
+    // a chord on the choir simulated at a lower rate than the output
+    {"choir", 48000, 32000, 4, PITCH_BATCH, 0.5, [] (Nanceloid &synth) {
+        make_shape (synth, 3, 0.6, 0.5);
+    }, {
+        {0.00, {0xc0, 3, 0}},
+        {0.00, {0x90, 48, 100}},
+        {0.05, {0x90, 55, 90}},
+        {0.10, {0x90, 60, 80}},
+        {0.15, {0x90, 64, 70}},
+        {0.30, {0x80, 55, 0}},
+        {0.40, {0x80, 48, 0}},
+    }},
+    // fewer junctions than samples of delay simulated above the output rate
+    {"junctions", 44100, 96000, 1, PITCH_BATCH, 0.5, [] (Nanceloid &synth) {
+        synth.params.junctions.value = 16;
+        synth.params.tract_length.value = 18;
+    }, {
+        {0.00, {0x90, 52, 100}},
+        {0.40, {0x80, 52, 0}},
+    }},
+    // the shortest tract at the lowest internal rate so it has the fewest segments there can be
+    {"low_rate", 44100, 4000, 1, PITCH_BATCH, 0.5, [] (Nanceloid &synth) {
+        synth.params.tract_length.value = synth.params.tract_length.min;
+    }, {
+        {0.00, {0x90, 45, 100}},
+        {0.40, {0x80, 45, 0}},
+    }},
+};
+
+// render a scenario from a fresh seeded instance into interleaved stereo
+vector<float> render (const Scenario &scenario) {
+    Nanceloid *synth = new Nanceloid ();
+    synth->set_seed (0);
+    synth->set_pitch_detection (scenario.pitch_detection);
+    synth->set_polyphony (scenario.voices);
+    scenario.setup (*synth);
+    synth->set_internal_rate (scenario.internal_rate);
+    synth->set_rate (scenario.rate);
+
+    long total = (long) round (scenario.seconds * scenario.rate);
+    vector<float> output (total * 2);
+    size_t next = 0;
+    long frame = 0;
+    while (frame < total) {
+        while (next < scenario.events.size () && (long) round (scenario.events[next].time * scenario.rate) <= frame) {
+            ScriptEvent event = scenario.events[next++];
+            synth->midi (event.data);
+        }
+        long until = total;
+        if (next < scenario.events.size ())
+            until = min (until, (long) round (scenario.events[next].time * scenario.rate));
+        int frames = (int) min (256L, until - frame);
+        synth->run_interleaved (&output[frame * 2], frames);
+        frame += frames;
+    }
+    delete synth;
+    return output;
+}
+
+// average over frames and channels of the rms difference of the log power spectra in db
+double spectral_distance (const vector<float> &a, const vector<float> &b, int channels) {
+    const int size = 1024;
+    const int hop = size / 2;
+    const double floor = 1e-10;     // power below this counts as silence
+    FFT fft;
+    fft.plan (size);
+    complex<double> sa[size];
+    complex<double> sb[size];
+    long frames = min (a.size (), b.size ()) / channels;
+    double total = 0;
+    int count = 0;
+    for (int c = 0; c < channels; c++) {
+        for (long start = 0; start + size <= frames; start += hop) {
+            for (int i = 0; i < size; i++) {
+                double window = 0.5 - 0.5 * cos (2 * M_PI * i / size);
+                sa[i] = a[(start + i) * channels + c] * window;
+                sb[i] = b[(start + i) * channels + c] * window;
+            }
+            fft.forward (sa);
+            fft.forward (sb);
+            double sum = 0;
+            for (int i = 0; i <= size / 2; i++) {
+                double d = 10 * log10 ((norm (sa[i]) + floor) / (norm (sb[i]) + floor));
+                sum += d * d;
+            }
+            total += sqrt (sum / (size / 2 + 1));
+            count++;
+        }
+    }
+    return count ? total / count : 0;
+}
+
+void print_usage_and_exit (char *command) {
+    cerr << "Usage: " << command << " [-u] [-m comparison] [-e tolerance] [-d directory] [scenario ...]\n\n";
+    cerr << "-u\n\tRender and save the golden outputs instead of comparing against them.\n\n";
+    cerr << "-m comparison\n\tSpecify how renders are compared, either exact, maxabs or spectral.\n\tIf left unspecified it is exact.\n\n";
+    cerr << "-e tolerance\n\tSpecify the largest difference allowed by maxabs or the largest distance in db allowed by spectral.\n\tIf left unspecified it is 0.\n\n";
+    cerr << "-d directory\n\tSpecify where the golden outputs are kept.\n\tIf left unspecified it is golden.\n\n";
+    cerr << "Scenarios:\n";
+    for (const Scenario &scenario : scenarios)
+        cerr << "\t" << scenario.name << "\n";
+    cerr << flush;
+    exit (EXIT_FAILURE);
+}
+
+int main (int argc, char **argv) {
+    // default cli args
+    bool update = false;
+    Comparison comparison = COMPARE_EXACT;
+    double tolerance = 0;
+    string directory = "golden";
+
+    // parse cli args
+    int c;
+    while ((c = getopt (argc, argv, "um:e:d:")) != -1) {
+        switch (c) {
+            case 'u':
+                update = true;
+                break;
+            case 'm':
+                if (!strcmp (optarg, "exact"))
+                    comparison = COMPARE_EXACT;
+                else if (!strcmp (optarg, "maxabs"))
+                    comparison = COMPARE_MAX_ABS;
+                else if (!strcmp (optarg, "spectral"))
+                    comparison = COMPARE_SPECTRAL;
+                else
+                    print_usage_and_exit (argv[0]);
+                break;
+            case 'e':
+                tolerance = atof (optarg);
+                break;
+            case 'd':
+                directory = optarg;
+                break;
+            default:
+                print_usage_and_exit (argv[0]);
+        }
+    }
+
+    int failures = 0;
+    int ran = 0;
+    for (const Scenario &scenario : scenarios) {
+        // only the named scenarios if any were
+        bool selected = optind == argc;
+        for (int i = optind; i < argc; i++)
+            selected |= !strcmp (argv[i], scenario.name);
+        if (!selected)
+            continue;
+        ran++;
+
+        string path = directory + "/" + scenario.name + ".wav";
+        vector<float> output = render (scenario);
+        if (update) {
+            WavWriter wav;
+            if (!wav.open (path.c_str (), scenario.rate, 2, SAMPLE_FLOAT32)) {
+                cerr << "Could not create " << path << endl;
+                return EXIT_FAILURE;
+            }
+            wav.write (output.data (), output.size () / 2);
+            cout << "updated " << path << endl;
+            continue;
+        }
+
+        vector<float> golden;
+        int rate = 0, channels = 0;
+        if (!read_wav (path.c_str (), golden, rate, channels) || channels != 2) {
+            cout << "FAIL " << scenario.name << ": could not read " << path << endl;
+            failures++;
+            continue;
+        }
+
+        // every measure is reported whichever one decides
+        bool same_size = golden.size () == output.size () && rate == scenario.rate;
+        bool exact = same_size && !memcmp (golden.data (), output.data (), output.size () * sizeof (float));
+        double max_abs = 0;
+        for (size_t i = 0; i < min (golden.size (), output.size ()); i++)
+            max_abs = fmax (max_abs, fabs (golden[i] - output[i]));
+        double distance = spectral_distance (output, golden, 2);
+        bool pass = same_size;
+        if (comparison == COMPARE_EXACT)
+            pass = exact;
+        else if (comparison == COMPARE_MAX_ABS)
+            pass &= max_abs <= tolerance;
+        else
+            pass &= distance <= tolerance;
+        if (!pass)
+            failures++;
+        cout << (pass ? "ok   " : "FAIL ") << scenario.name
+             << ": exact " << (exact ? "yes" : "no")
+             << ", max abs " << max_abs
+             << ", spectral " << distance << " db"
+             << (same_size ? "" : ", length or rate differs") << endl;
+    }
+    if (ran == 0)
+        print_usage_and_exit (argv[0]);
+    return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -1,22 +1,91 @@
 #include <iostream>
 #include <vector>
+#include <cstring>
 #include <unistd.h>
+#include <csignal>
+#include <chrono>
 #include <RtMidi.h>
+#include <RtAudio.h>
 #include <SFML/Graphics.hpp>
 #include <SFML/Audio.hpp>
 #include <nanceloid.h>
+#include <midi_queue.h>
+#include <audio.h>
+#include <convert.h>
+#include <callback_stats.h>
+#include <triple_buffer.h>
+#include <ring_buffer.h>
 
 using namespace std;
 
 // the vocal synth instance
 Nanceloid *synth;
 
+// midi from the midi input and gui threads to the audio thread
+enum MidiSource {
+    MIDI_SOURCE_INPUT,
+    MIDI_SOURCE_GUI,
+    MIDI_SOURCES,
+};
+MidiQueue midi_queue (MIDI_SOURCES);
+
+// how the audio callback keeps up with its deadlines
+CallbackStats callback_stats;
+
+// what the gui shows, copied out by the audio thread after every period
+// so the gui never reads the synth while it runs
+struct Telemetry {
+    static const int shape_points = 64;
+    static const int max_scope_points = 1024;
+
+    double diameter[shape_points] = {};  // tract shape from the glottis to the lips
+    float scope[max_scope_points] = {};  // the last period or so of output lined up on its minimum
+    int scope_points = 0;
+    int shape_id = 0;
+    double velic_closure = 0;       // where the velum is now
+    double target_velic_closure = 0;// where the shape wants it
+    double voicing = 0;
+    double frequency = 0;
+    double detected_frequency = 0;
+    int playing_note = -1;
+    Parameters params;              // the values the audio thread was using
+};
+TripleBuffer<Telemetry> telemetry;
+bool publish_telemetry = false;     // only worth doing with the gui open
+
+// edits from the gui to the audio thread
+enum GuiCommandType {
+    GUI_SET_PARAMETER,      // index into Parameters::as_array
+    GUI_SET_SHAPE_SAMPLE,   // position 0 to 1 along the tract
+    GUI_SET_VELIC_CLOSURE,
+    GUI_SET_SHAPE_ID,
+};
+struct GuiCommand {
+    GuiCommandType type;
+    int index;
+    double position;
+    double value;
+};
+RingBuffer<GuiCommand> gui_commands (256);
+
+// set by ctrl-c so the headless mode can print the stats on the way out
+std::atomic<bool> quit {false};
+
 // the midi channel to listen on
 // -1 means omni listen
 int midi_channel = -1;
 
-const float default_buffer_size = 2048;
+const int default_period = 256;
 const float default_sample_rate = 44100;
+const char *default_output_path = "nanceloid.wav";
+
+// ways of playing the audio
+enum Backend {
+    BACKEND_RTAUDIO,    // the default device through rtaudio
+    BACKEND_SFML,       // sfml streaming
+    BACKEND_NULL,       // timed like a device but thrown away
+    BACKEND_WAV,        // timed like a device and written to a file
+};
 
 void exit_error (string message) {
     cerr << message << endl;
@@ -24,25 +93,19 @@ void exit_error (string message) {
 }
 
 void process_midi (double dt, vector<unsigned char> *message, void *user_data) {
-    // convert this vector to an array
-    int num_bytes = message->size ();
-    uint8_t *data = new uint8_t[num_bytes];
-    copy (message->begin (), message->end (), data);
+    if (message->empty ())
+        return;
 
     // midi channel masking
     if (midi_channel != -1) {
-        uint8_t channel = data[0] & 0x0f;
-        if (channel != midi_channel) {
-            delete data;
+        uint8_t channel = (*message)[0] & 0x0f;
+        if (channel != midi_channel)
             return;
-        }
     }
 
-    // send to the synth
-    synth->midi (data);
-
-    // done with the data
-    delete data;
+    // send to the audio thread
+    // sysex and anything else longer than a channel message is dropped
+    midi_queue.push (MIDI_SOURCE_INPUT, message->data (), message->size ());
 }
 
 void setup_midi () {
@@ -66,72 +129,266 @@ void setup_midi () {
 }
 
 void print_usage_and_exit (char *command) {
-    cerr << "Usage: " << command << " [-c channel] [-b buffer size] [-s sample rate] [-d]\n\n";
+    cerr << "Usage: " << command << " [-c channel] [-a backend] [-b period] [-s sample rate] [-i internal rate] [-p pitch detection] [-v voices] [-o output] [-f format] [-d]\n\n";
     cerr << "-c channel\n\tSpecify the midi channel to listen on.\n\tIf left unspecified it will listen on all channels.\n\n";
-    cerr << "-b buffer size\n\tSpecify the size of the audio buffer in number of samples.\n\tIf left unspecified it is " << default_buffer_size << ".\n\n";
+    cerr << "-a backend\n\tSpecify how the audio is played, either rtaudio, sfml, null or wav.\n\tnull and wav run on a timer like a device without any sound hardware, wav writes the output to a file.\n\tIf left unspecified it is rtaudio.\n\n";
+    cerr << "-b period\n\tSpecify the number of frames rendered at a time.\n\tIf left unspecified it is " << default_period << ".\n\n";
     cerr << "-s sample rate\n\tSpecify the audio sampling rate in samples per second.\n\tIf left unspecified it is " << default_sample_rate << ".\n\n";
+    cerr << "-i internal rate\n\tSpecify the rate the voice is simulated at before resampling to the sample rate.\n\tLower is cheaper and higher is more stable for high notes.\n\tIf left unspecified it is the sample rate.\n\n";
+    cerr << "-p pitch detection\n\tSpecify how the playing pitch is detected, either batch, streaming or background.\n\tWith more than one voice every voice uses batch.\n\tIf left unspecified it is batch.\n\n";
+    cerr << "-v voices\n\tSpecify the number of notes that can play at once.\n\tIf left unspecified it is 1.\n\n";
+    cerr << "-o output\n\tSpecify the file the wav backend writes.\n\tIf left unspecified it is " << default_output_path << ".\n\n";
+    cerr << "-f format\n\tSpecify the sample format the wav backend writes, either 16, 24 or float.\n\tIf left unspecified it is 16.\n\n";
     cerr << "-d\n\tDisable the GUI.\n\n";
     cerr << flush;
     exit (EXIT_FAILURE);
 }
 
-class SoundStream : public sf::SoundStream {
+// make the edits the gui asked for from the audio thread
+void apply_gui_commands () {
+    GuiCommand command;
+    while (gui_commands.pop (command)) {
+        switch (command.type) {
+            case GUI_SET_PARAMETER:
+                synth->params.as_array ()[command.index].value = command.value;
+                break;
+            case GUI_SET_SHAPE_SAMPLE:
+                synth->get_shape ().set_sample (command.position, command.value);
+                break;
+            case GUI_SET_VELIC_CLOSURE:
+                synth->get_shape ().velic_closure = command.value;
+                break;
+            case GUI_SET_SHAPE_ID:
+                synth->set_shape_id (command.index);
+                break;
+        }
+    }
+}
+
+// copy what the gui shows from the audio thread
+void update_telemetry () {
+    Telemetry &t = telemetry.get_back ();
+    for (int i = 0; i < Telemetry::shape_points; i++)
+        t.diameter[i] = synth->get_diameter ((double) i / (Telemetry::shape_points - 1));
+    synth->prepare_scope ();
+    t.scope_points = min (synth->get_scope_samples (), (int) Telemetry::max_scope_points);
+    for (int i = 0; i < t.scope_points; i++)
+        t.scope[i] = synth->get_scope ((double) i / max (1, t.scope_points - 1));
+    t.shape_id = synth->get_shape_id ();
+    t.velic_closure = synth->get_velic_closure ();
+    t.target_velic_closure = synth->get_shape ().velic_closure;
+    t.voicing = synth->get_voicing ();
+    t.frequency = synth->get_frequency ();
+    t.detected_frequency = synth->get_detected_frequency ();
+    t.playing_note = synth->playing_note ();
+    t.params = synth->params;
+    telemetry.publish ();
+}
+
+// render a period of interleaved frames for whichever backend is playing
+void render_audio (float *out, int frames, double rate) {
+    auto start = std::chrono::steady_clock::now ();
+    long first_tick = synth->get_control_ticks ();
+    apply_gui_commands ();
+
+    // render from event to event so each one lands on the frame it arrived at
+    midi_queue.begin_block (frames, rate);
+    int frame = 0;
+    while (frame < frames) {
+        uint8_t data[3];
+        while (midi_queue.pop (frame, data))
+            synth->midi (data);
+        int until = midi_queue.next_offset ();
+        synth->run_interleaved (out + frame * 2, until - frame);
+        frame = until;
+    }
+    if (publish_telemetry)
+        update_telemetry ();
+
+    // the period has to be ready before the device finishes playing the last one
+    double duration = std::chrono::duration<double> (std::chrono::steady_clock::now () - start).count ();
+    callback_stats.record (duration, frames / rate, first_tick, synth->get_control_ticks () - first_tick);
+}
+
+void handle_signal (int sig) {
+    quit = true;
+}
+
+// plays through the default output device with rtaudio calling back for each period
+// the device takes floats directly so nothing is converted
+class RtAudioBackend : public AudioBackend {
     private:
-        Nanceloid *synth;
-        sf::Int16 *m_samples;
-        int buffer_size;
+        RtAudio *dac = nullptr;
+        Callback callback;
+        std::atomic<long> xruns {0};
+
+        static int process (void *output, void *input, unsigned int frames, double time, RtAudioStreamStatus status, void *user_data) {
+            RtAudioBackend *backend = (RtAudioBackend *) user_data;
+            if (status & RTAUDIO_OUTPUT_UNDERFLOW)
+                backend->xruns++;
+            backend->callback ((float *) output, frames);
+            return 0;
+        }
 
     public:
-        SoundStream (Nanceloid *synth, int buffer_size, int rate)
-            : synth (synth), buffer_size (buffer_size)
-        {
-            initialize (2, rate);
-            synth->set_rate (rate);
-            m_samples = new sf::Int16[buffer_size];
+        ~RtAudioBackend () {
+            stop ();
         }
 
-        ~SoundStream () {
-            delete m_samples;
+        bool start (Callback callback, int rate, int period) {
+            stop ();
+            this->callback = callback;
+            dac = new RtAudio ();
+            if (dac->getDeviceCount () == 0)
+                return false;
+            RtAudio::StreamParameters parameters;
+            parameters.deviceId = dac->getDefaultOutputDevice ();
+            parameters.nChannels = 2;
+            parameters.firstChannel = 0;
+            RtAudio::StreamOptions options;
+            options.flags = RTAUDIO_MINIMIZE_LATENCY | RTAUDIO_SCHEDULE_REALTIME;
+            options.numberOfBuffers = 2;
+            unsigned int frames = period;
+            // older versions of rtaudio throw and newer ones return errors
+            try {
+                dac->openStream (&parameters, nullptr, RTAUDIO_FLOAT32, rate, &frames, &process, this, &options);
+                if (dac->isStreamOpen ())
+                    dac->startStream ();
+            } catch (...) {}
+            return dac->isStreamRunning ();
         }
 
-        virtual bool onGetData (Chunk &data) {
-            data.samples = m_samples;
-            data.sampleCount = buffer_size;
-
-            // fill the buffer for sfml
-            float samples[2];
-            const int max = 32767;
-            for (int i = 0; i < buffer_size; i += 2) {
-                synth->run (samples);
-                m_samples[i]     = (sf::Int16) (samples[0] * max);
-                m_samples[i + 1] = (sf::Int16) (samples[1] * max);
-            }
+        void stop () {
+            if (dac == nullptr)
+                return;
+            try {
+                if (dac->isStreamRunning ())
+                    dac->stopStream ();
+                if (dac->isStreamOpen ())
+                    dac->closeStream ();
+            } catch (...) {}
+            delete dac;
+            dac = nullptr;
+        }
+
+        bool is_running () {
+            return dac && dac->isStreamRunning ();
+        }
+
+        long get_xruns () {
+            return xruns.load ();
+        }
+};
+
+// plays through sfml which asks for the next period itself
+// sfml only checks for more every 10ms or so which rules out the smallest periods
+class SfmlBackend : public AudioBackend, private sf::SoundStream {
+    private:
+        Callback callback;
+        int period = 0;
+        float *buffer = nullptr;
+        sf::Int16 *samples = nullptr;
+        SampleConverter converter;
+
+        bool onGetData (Chunk &data) {
+            callback (buffer, period);
+            converter.to_int16 (buffer, samples, period * 2);
+            data.samples = samples;
+            data.sampleCount = period * 2;
+            return true;
+        }
+
+        void onSeek (sf::Time timeOffset) {}
+
+    public:
+        ~SfmlBackend () {
+            stop ();
+            delete[] buffer;
+            delete[] samples;
+        }
 
+        bool start (Callback callback, int rate, int period) {
+            stop ();
+            this->callback = callback;
+            this->period = period;
+            delete[] buffer;
+            delete[] samples;
+            buffer = new float[period * 2];
+            samples = new sf::Int16[period * 2];
+            initialize (2, rate);
+            play ();
             return true;
         }
-        
-        virtual void onSeek (sf::Time timeOffset) {}
+
+        void stop () {
+            sf::SoundStream::stop ();
+        }
+
+        bool is_running () {
+            return getStatus () == sf::Sound::Playing;
+        }
 };
 
 int main (int argc, char **argv) {
     // default cli args
-    float buffer_size = default_buffer_size;
+    Backend backend_type = BACKEND_RTAUDIO;
+    int period = default_period;
     float sample_rate = default_sample_rate;
+    float internal_rate = 0;
     int enable_gui = true;
+    PitchDetection pitch_detection = PITCH_BATCH;
+    int voices = 1;
+    const char *output_path = default_output_path;
+    SampleFormat format = SAMPLE_INT16;
 
     // parse cli args
     int c;
-    while ((c = getopt (argc, argv, "c:b:s:d")) != -1) {
+    while ((c = getopt (argc, argv, "c:a:b:s:i:p:v:o:f:d")) != -1) {
         switch (c) {
             case 'c':
                 midi_channel = atoi (optarg);
                 break;
+            case 'a':
+                if (!strcmp (optarg, "rtaudio"))
+                    backend_type = BACKEND_RTAUDIO;
+                else if (!strcmp (optarg, "sfml"))
+                    backend_type = BACKEND_SFML;
+                else if (!strcmp (optarg, "null"))
+                    backend_type = BACKEND_NULL;
+                else if (!strcmp (optarg, "wav"))
+                    backend_type = BACKEND_WAV;
+                else
+                    print_usage_and_exit (argv[0]);
+                break;
             case 'b':
-                buffer_size = atoi (optarg);
+                period = atoi (optarg);
                 break;
             case 's':
                 sample_rate = atoi (optarg);
                 break;
+            case 'i':
+                internal_rate = atoi (optarg);
+                break;
+            case 'p':
+                if (!strcmp (optarg, "batch"))
+                    pitch_detection = PITCH_BATCH;
+                else if (!strcmp (optarg, "streaming"))
+                    pitch_detection = PITCH_STREAMING;
+                else if (!strcmp (optarg, "background"))
+                    pitch_detection = PITCH_BACKGROUND;
+                else
+                    print_usage_and_exit (argv[0]);
+                break;
+            case 'v':
+                voices = atoi (optarg);
+                break;
+            case 'o':
+                output_path = optarg;
+                break;
+            case 'f':
+                if (!parse_sample_format (optarg, format))
+                    print_usage_and_exit (argv[0]);
+                break;
             case 'd':
                 enable_gui = false;
                 break;
@@ -142,13 +399,30 @@ int main (int argc, char **argv) {
 
     // setup the synth
     synth = new Nanceloid ();
+    synth->set_pitch_detection (pitch_detection);
+    synth->set_polyphony (voices);
+    synth->set_internal_rate (internal_rate);
 
     // setup midi
     setup_midi ();
 
-    // create and start playing the audio stream
-    SoundStream stream (synth, buffer_size, sample_rate);
-    stream.play ();
+    if (period <= 0 || sample_rate <= 0)
+        print_usage_and_exit (argv[0]);
+    synth->set_rate (sample_rate);
+
+    // start playing the audio
+    publish_telemetry = enable_gui;
+    AudioBackend *backend;
+    if (backend_type == BACKEND_RTAUDIO)
+        backend = new RtAudioBackend ();
+    else if (backend_type == BACKEND_SFML)
+        backend = new SfmlBackend ();
+    else if (backend_type == BACKEND_NULL)
+        backend = new TimerBackend ();
+    else
+        backend = new TimerBackend (output_path, format);
+    if (!backend->start ([sample_rate] (float *out, int frames) { render_audio (out, frames, sample_rate); }, sample_rate, period))
+        exit_error ("Could not start the audio output.");
 
     if (enable_gui) {
         // setup gui window
@@ -174,6 +448,15 @@ int main (int argc, char **argv) {
         sf::View view (sf::FloatRect(-1, -1, 2, 2));
         window.setView (view);
 
+        // edits go to the audio thread rather than the synth
+        // if the queue is full the edit is dropped and the next event tries again
+        auto send = [] (GuiCommandType type, int index, double position, double value) {
+            gui_commands.push ({type, index, position, value});
+        };
+        auto set_parameter = [&send] (Telemetry &t, Parameter &parameter, double value) {
+            send (GUI_SET_PARAMETER, &parameter - t.params.as_array (), 0, value);
+        };
+
         // event loop
         bool mouse_down = false;
         double mouse_x = 0;
@@ -182,34 +465,43 @@ int main (int argc, char **argv) {
         {
             window.clear ();
 
+            // everything shown comes from the latest period the audio thread rendered
+            telemetry.update ();
+            Telemetry &t = telemetry.get_front ();
+
             // draw tract shape
-            const int res = 64;
+            const int res = Telemetry::shape_points;
             sf::VertexArray lines (sf::LinesStrip, res);
             sf::VertexArray lines2 (sf::LinesStrip, res);
             for (int j = 0; j < res; j++) {
                 double n = (double) j / (res - 1);
-                double sample = synth->shape.sample (n);
+                double sample = t.diameter[j];
                 lines[j].position = sf::Vector2f (n * 2 - 1, sample);
                 lines2[j].position = sf::Vector2f (n * 2 - 1, -sample);
             }
             // text display
             stringstream display_string;
-            display_string << "Patch         #" << synth->get_shape_id () << "\n";
-            display_string << "Velic closure: " << (int) round (synth->shape.velic_closure * 100) << "%\n";
-            display_string << "Voicing:       " << (int) round (synth->get_voicing () * 100) << "%\n";
-            display_string << "Second fold:   " << (int) round (synth->params.second_fold.value * 100) << "%\n";
-            display_string << "Uvula:         " << (int) round (synth->params.uvula.value * 100) << "%\n";
-            display_string << "Frequency:     " << round (synth->get_frequency () * 100) / 100 << "hz\n";
-            display_string << "Detected:      " << round (synth->get_detected_frequency () * 100) / 100 << "hz\n";
-            display_string << "Correction:    " << (int) round (synth->params.correction.value * 100) << "%\n";
+            display_string << "Patch         #" << t.shape_id << "\n";
+            display_string << "Velic closure: " << (int) round (t.velic_closure * 100) << "%\n";
+            display_string << "Voicing:       " << (int) round (t.voicing * 100) << "%\n";
+            display_string << "Second fold:   " << (int) round (t.params.second_fold.value * 100) << "%\n";
+            display_string << "Uvula:         " << (int) round (t.params.uvula.value * 100) << "%\n";
+            display_string << "Frequency:     " << round (t.frequency * 100) / 100 << "hz\n";
+            display_string << "Detected:      " << round (t.detected_frequency * 100) / 100 << "hz\n";
+            display_string << "Correction:    " << (int) round (t.params.correction.value * 100) << "%\n";
+            CallbackStats::Worst worst = callback_stats.get_worst ();
+            display_string << "Load:          " << (int) round (callback_stats.get_mean_load () * 100) << "% mean, "
+                           << (int) round (worst.duration / worst.deadline * 100) << "% worst\n";
+            display_string << "Misses:        " << callback_stats.get_misses () << " of " << callback_stats.get_calls ()
+                           << ", " << backend->get_xruns () << " xruns\n";
+            display_string << "Worst tick:    #" << worst.first_tick << " (" << worst.ticks << " ran)\n";
             text.setString (display_string.str ());
             // scope
-            synth->prepare_scope ();
-            int samples = synth->get_scope_samples ();
+            int samples = t.scope_points;
             sf::VertexArray lines_scope (sf::LinesStrip, samples);
             for (int j = 0; j < samples; j++) {
                 double n = (double) j / (samples - 1);
-                float sample = synth->get_scope (n);
+                float sample = t.scope[j];
                 lines_scope[j].position = sf::Vector2f (n * 2 - 1, -sample);
                 lines_scope[j].color = sf::Color::Red;
             }
@@ -248,41 +540,56 @@ int main (int argc, char **argv) {
                     if (event.key.code == sf::Keyboard::Escape)
                         window.close ();
                     else if (event.key.code == sf::Keyboard::Hyphen)
-                        synth->params.correction.value = synth->params.correction.value ?  0 : 0.2;
+                        set_parameter (t, t.params.correction, t.params.correction.value ?  0 : 0.2);
                     else if (event.key.code == sf::Keyboard::Equal)
-                        synth->params.uvula.value = synth->params.uvula.value ?  0 : 0.1;
+                        set_parameter (t, t.params.uvula, t.params.uvula.value ?  0 : 0.1);
                     else if (event.key.code == sf::Keyboard::Enter)
-                        synth->params.second_fold.value = synth->params.second_fold.value ?  0 : 1;
+                        set_parameter (t, t.params.second_fold, t.params.second_fold.value ?  0 : 1);
                     else if (event.key.code == sf::Keyboard::Tab)
-                        synth->get_shape ().velic_closure = synth->get_shape ().velic_closure ?  0 : 1;
+                        send (GUI_SET_VELIC_CLOSURE, 0, 0, t.target_velic_closure ?  0 : 1);
                     else if (event.key.code == sf::Keyboard::Backspace)
-                        synth->params.voicing.value = synth->params.voicing.value ?  0 : 1;
+                        set_parameter (t, t.params.voicing, t.params.voicing.value ?  0 : 1);
                     else if (event.key.code == sf::Keyboard::Space) {
-                        int note = synth->playing_note ();
-                        if (note == -1)
-                            synth->note_on (45+12+3, 1);
-                        else
-                            synth->note_off (note);
+                        // played through the audio thread like any other midi
+                        int note = t.playing_note;
+                        uint8_t data[3] = {0x90, (uint8_t) (45+12+3), 127};
+                        if (note != -1) {
+                            data[0] = 0x80;
+                            data[1] = note;
+                            data[2] = 0;
+                        }
+                        midi_queue.push (MIDI_SOURCE_GUI, data, 3);
                     }
                 } else if (event.type == sf::Event::TextEntered) {
                     // switch to patches corresponding to lower case letters
                     char c = event.text.unicode;
                     if (c >= 97 && c <= 122)
-                        synth->set_shape_id (c);
+                        send (GUI_SET_SHAPE_ID, c, 0, 0);
                 }
                 if (mouse_down) {
                     double sample = fmax (0, mouse_y);
                     double n = (mouse_x + 1) / 2;
-                    synth->get_shape ().set_sample (n, sample);
+                    send (GUI_SET_SHAPE_SAMPLE, 0, n, sample);
                 }
             }
         }
     } else {
-        while (stream.getStatus () == sf::Sound::Playing)
-            sf::sleep (sf::seconds (1));
+        signal (SIGINT, handle_signal);
+        signal (SIGTERM, handle_signal);
+        while (backend->is_running () && !quit)
+            sf::sleep (sf::milliseconds (100));
     }
 
     // cleanup and done
+    backend->stop ();
+    if (!enable_gui) {
+        callback_stats.print ();
+        cout << "device xruns " << backend->get_xruns () << endl;
+#ifdef STAGE_COUNTERS
+        synth->get_stage_counters ().print (cout);
+#endif
+    }
+    delete backend;
     delete synth;
     return 0;
 }
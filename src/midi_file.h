@@ -0,0 +1,188 @@
+#pragma once
+
+#include <cstdio>
+#include <cstdint>
+#include <vector>
+#include <algorithm>
+
+// reads the channel messages of a standard midi file with the time each one happens at
+// every track is merged into one list in time order and tempo changes are applied along the way
+class MidiFile {
+    public:
+        struct Event {
+            double time;        // seconds from the start of the file
+            uint8_t data[3];    // status byte and up to 2 data bytes
+            int size;
+        };
+
+    private:
+        std::vector<Event> events;
+
+        // a channel message or tempo change at a tick in a track
+        struct TrackEvent {
+            long tick;
+            int tempo;          // microseconds per quarter note for a tempo change
+            Event event;        // size 0 for a tempo change
+        };
+
+        static uint32_t read_be (const uint8_t *p, int bytes) {
+            uint32_t value = 0;
+            for (int i = 0; i < bytes; i++)
+                value = (value << 8) | p[i];
+            return value;
+        }
+
+        // read a variable length quantity
+        // returns false if it runs past the end
+        static bool read_vlq (const uint8_t *&p, const uint8_t *end, uint32_t &value) {
+            value = 0;
+            for (int i = 0; i < 4; i++) {
+                if (p >= end)
+                    return false;
+                uint8_t byte = *p++;
+                value = (value << 7) | (byte & 0x7f);
+                if (!(byte & 0x80))
+                    return true;
+            }
+            return false;
+        }
+
+        // parse the events of one track chunk
+        static bool read_track (const uint8_t *p, const uint8_t *end, std::vector<TrackEvent> &out) {
+            long tick = 0;
+            uint8_t status = 0;
+            while (p < end) {
+                uint32_t delta;
+                if (!read_vlq (p, end, delta) || p >= end)
+                    return false;
+                tick += delta;
+
+                // running status reuses the last channel status byte
+                if (*p & 0x80)
+                    status = *p++;
+                else if (status == 0)
+                    return false;
+
+                if (status == 0xff) {
+                    // meta event, only tempo changes and the end of the track matter
+                    if (p >= end)
+                        return false;
+                    uint8_t type = *p++;
+                    uint32_t length;
+                    if (!read_vlq (p, end, length) || length > (uint32_t) (end - p))
+                        return false;
+                    if (type == 0x51 && length == 3)
+                        out.push_back ({tick, (int) read_be (p, 3), {}});
+                    p += length;
+                    status = 0;
+                    if (type == 0x2f)
+                        break;
+                } else if (status == 0xf0 || status == 0xf7) {
+                    // sysex is skipped
+                    uint32_t length;
+                    if (!read_vlq (p, end, length) || length > (uint32_t) (end - p))
+                        return false;
+                    p += length;
+                    status = 0;
+                } else {
+                    // channel message with 1 data byte for program and channel pressure and 2 otherwise
+                    uint8_t type = status & 0xf0;
+                    int size = type == 0xc0 || type == 0xd0 ? 2 : 3;
+                    if (end - p < size - 1)
+                        return false;
+                    TrackEvent e = {tick, 0, {0, {status, 0, 0}, size}};
+                    for (int i = 1; i < size; i++)
+                        e.event.data[i] = *p++ & 0x7f;
+                    out.push_back (e);
+                }
+            }
+            return true;
+        }
+
+    public:
+        // load a file replacing any events already loaded
+        // returns false if it couldn't be read or isn't a standard midi file
+        bool load (const char *path) {
+            events.clear ();
+            FILE *file = fopen (path, "rb");
+            if (file == nullptr)
+                return false;
+            std::vector<uint8_t> bytes;
+            uint8_t buffer[4096];
+            size_t n;
+            while ((n = fread (buffer, 1, sizeof (buffer), file)) > 0)
+                bytes.insert (bytes.end (), buffer, buffer + n);
+            fclose (file);
+
+            // header chunk
+            const uint8_t *p = bytes.data ();
+            const uint8_t *end = p + bytes.size ();
+            if (bytes.size () < 14 || read_be (p, 4) != 0x4d546864)  // MThd
+                return false;
+            uint32_t header_length = read_be (p + 4, 4);
+            if (header_length < 6 || header_length > bytes.size () - 8)
+                return false;
+            int tracks = read_be (p + 10, 2);
+            int division = read_be (p + 12, 2);
+            p += 8 + header_length;
+
+            // every track chunk into one list
+            std::vector<TrackEvent> merged;
+            for (int t = 0; t < tracks && end - p >= 8; t++) {
+                uint32_t id = read_be (p, 4);
+                uint32_t length = read_be (p + 4, 4);
+                p += 8;
+                if (length > (uint32_t) (end - p))
+                    return false;
+                // unknown chunks are skipped
+                if (id == 0x4d54726b) {     // MTrk
+                    std::vector<TrackEvent> track;
+                    if (!read_track (p, p + length, track))
+                        return false;
+                    merged.insert (merged.end (), track.begin (), track.end ());
+                } else {
+                    t--;
+                }
+                p += length;
+            }
+            // events at the same tick keep their order in the file
+            std::stable_sort (merged.begin (), merged.end (), [] (const TrackEvent &a, const TrackEvent &b) {
+                return a.tick < b.tick;
+            });
+
+            // convert ticks to seconds following the tempo
+            // smpte divisions have a fixed number of ticks per second
+            double seconds_per_tick;
+            bool smpte = division & 0x8000;
+            if (smpte && (division & 0xff) && (int8_t) (division >> 8) < 0)
+                seconds_per_tick = 1.0 / (-(int8_t) (division >> 8) * (division & 0xff));
+            else if (!smpte && division > 0)
+                seconds_per_tick = 0.5 / division;      // 120 bpm until a tempo change
+            else
+                return false;
+            long last_tick = 0;
+            double time = 0;
+            for (TrackEvent &e : merged) {
+                time += (e.tick - last_tick) * seconds_per_tick;
+                last_tick = e.tick;
+                if (e.event.size == 0) {
+                    if (!smpte && e.tempo > 0)
+                        seconds_per_tick = e.tempo / 1e6 / division;
+                } else {
+                    e.event.time = time;
+                    events.push_back (e.event);
+                }
+            }
+            return true;
+        }
+
+        // the channel messages in time order
+        const std::vector<Event> &get_events () {
+            return events;
+        }
+
+        // time of the last event in seconds
+        double get_length () {
+            return events.empty () ? 0 : events.back ().time;
+        }
+};
@@ -0,0 +1,109 @@
+#pragma once
+
+#include <ring_buffer.h>
+#include <chrono>
+#include <cstdint>
+#include <cmath>
+#include <algorithm>
+
+// midi messages passed from input threads to the audio thread with the time they arrived
+// every input thread gets its own lock free queue so none of them ever blocks or allocates
+// the audio thread plays each buffer of events back one buffer later at the spacing they arrived with
+// so the timing no longer depends on where in the buffer size they happened to land
+class MidiQueue {
+    public:
+        // a channel message of up to 3 bytes
+        struct Event {
+            double time;        // seconds on the steady clock
+            uint8_t data[3];
+        };
+
+    private:
+        int source_count;
+        RingBuffer<Event> **queues;
+        // the buffer the audio thread is rendering
+        double block_start = 0;
+        double rate = 44100;
+        int frames = 0;
+
+        // the queue with the oldest event waiting or nullptr if they are all empty
+        RingBuffer<Event> *oldest () {
+            RingBuffer<Event> *oldest = nullptr;
+            double oldest_time = 0;
+            for (int i = 0; i < source_count; i++) {
+                Event *event = queues[i]->peek ();
+                if (event && (oldest == nullptr || event->time < oldest_time)) {
+                    oldest = queues[i];
+                    oldest_time = event->time;
+                }
+            }
+            return oldest;
+        }
+
+        // frame of the buffer an event lands on
+        // late events land at the start and ones from after the buffer past its end
+        int get_offset (const Event &event) {
+            double offset = (event.time - block_start) * rate;
+            return (int) std::max (0.0, std::min ((double) frames, floor (offset)));
+        }
+
+    public:
+        // a queue for each of a number of input threads
+        MidiQueue (int sources, int capacity = 1024) : source_count (sources) {
+            queues = new RingBuffer<Event> *[sources];
+            for (int i = 0; i < sources; i++)
+                queues[i] = new RingBuffer<Event> (capacity);
+        }
+
+        MidiQueue (const MidiQueue &) = delete;
+        MidiQueue &operator= (const MidiQueue &) = delete;
+
+        ~MidiQueue () {
+            for (int i = 0; i < source_count; i++)
+                delete queues[i];
+            delete[] queues;
+        }
+
+        // seconds on the clock events are stamped with
+        static double now () {
+            return std::chrono::duration<double> (std::chrono::steady_clock::now ().time_since_epoch ()).count ();
+        }
+
+        // add a message from the thread of a source stamped with the current time
+        // returns false and drops it if it is longer than 3 bytes or the queue is full
+        bool push (int source, const uint8_t *data, int size) {
+            if (size < 1 || size > 3)
+                return false;
+            Event event = {now (), {data[0], 0, 0}};
+            for (int i = 1; i < size; i++)
+                event.data[i] = data[i];
+            return queues[source]->push (event);
+        }
+
+        // start a buffer of frames from the audio thread
+        // it covers the time since the same amount before now
+        void begin_block (int frames, double rate) {
+            this->frames = frames;
+            this->rate = rate;
+            block_start = now () - frames / rate;
+        }
+
+        // get the next event due by a frame of the buffer from the audio thread
+        // returns false if there are no more
+        bool pop (int frame, uint8_t *data) {
+            RingBuffer<Event> *queue = oldest ();
+            if (queue == nullptr || get_offset (*queue->peek ()) > frame)
+                return false;
+            Event event;
+            queue->pop (event);
+            std::copy (event.data, event.data + 3, data);
+            return true;
+        }
+
+        // get the frame of the buffer the next event lands on
+        // the end of the buffer if there is none
+        int next_offset () {
+            RingBuffer<Event> *queue = oldest ();
+            return queue ? get_offset (*queue->peek ()) : frames;
+        }
+};
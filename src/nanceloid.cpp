@@ -1,57 +1,108 @@
 #include <nanceloid.h>
+#include <background_pitch.h>
+#include <choir.h>
+#include <scatter.h>
 #include <iostream>
 #include <cmath>
+#include <algorithm>
+#include <new>
 
 using namespace std;
 
-double noise () {
-    return (double) rand () / RAND_MAX;
-}
-
-double clip (double value) {
-    return fmin (5, fmax (-5, value));
-}
-
 Nanceloid::~Nanceloid () {
     free ();
+    delete choir;
+    delete pitch_analyzer;
 }
 
 void Nanceloid::free () {
-    if (r != nullptr)
-        delete r;
-    if (l != nullptr)
-        delete l;
-    if (r_ != nullptr)
-        delete r_;
-    if (l_ != nullptr)
-        delete l_;
-    if (r_junction != nullptr)
-        delete r_junction;
-    if (l_junction != nullptr)
-        delete l_junction;
-    if (nr != nullptr)
-        delete nr;
-    if (nl != nullptr)
-        delete nl;
-    if (nr_ != nullptr)
-        delete nr_;
-    if (nl_ != nullptr)
-        delete nl_;
+    if (arena != nullptr)
+        operator delete (arena, align_val_t (cache_line));
+    arena = nullptr;
+    r = l = r_junction = l_junction = nullptr;
+    nr = nl = nullptr;
+    scope = nullptr;
+    delete[] simulated;
+    delete[] resampled;
+    delete[] diameter;
+    delete[] impedance;
+    delete[] shape_cache_arena;
+    simulated = nullptr;
+    resampled = nullptr;
+    diameter = nullptr;
+    impedance = nullptr;
+    shape_cache_arena = nullptr;
+    for (ShapeCache &cache : shape_caches)
+        cache = ShapeCache ();
 }
 
 void Nanceloid::set_rate (double rate) {
-    if (rate != this->rate) {
-        this->rate = rate * super_sampling;
-        control_rate = this->rate / control_rate_divider;
-        dt = 1.0 / rate;
-        init ();
+    if (rate != host_rate) {
+        host_rate = rate;
+        update_rate ();
+    }
+}
+
+void Nanceloid::set_internal_rate (double rate) {
+    if (rate != internal_rate) {
+        internal_rate = rate;
+        if (host_rate)
+            update_rate ();
     }
 }
 
+double Nanceloid::get_internal_rate () {
+    return rate;
+}
+
+int Nanceloid::get_latency () {
+    return resampling ? resampler.get_latency () : 0;
+}
+
+void Nanceloid::update_rate () {
+    // the simulation runs at an exact ratio of the host rate so the resampler has a fixed set of phases
+    int up = 1;
+    int down = 1;
+    double target_rate = internal_rate > 0 ? max (internal_rate, min_internal_rate) : 0;
+    if (target_rate > 0 && target_rate != host_rate)
+        Resampler::get_ratio (target_rate, host_rate, max_resampler_phases, up, down);
+    resampling = up != down;
+    if (resampling)
+        resampler.init (up, down);
+    rate = host_rate * down / up;
+    control_rate = rate / control_rate_divider;
+    dt = 1.0 / rate;
+    init ();
+}
+
 double Nanceloid::get_detected_frequency () {
     return detected_frequency;
 }
 
+long Nanceloid::get_control_ticks () {
+    // a tick runs at the start of every control period that has been entered
+    return ((long) clock + control_rate_divider - 1) / control_rate_divider;
+}
+
+void Nanceloid::set_pitch_detection (PitchDetection mode) {
+    // only keep the analysis thread around while it is needed
+    // the choir detects the pitch of each voice itself so it never feeds the thread
+#ifdef NO_BACKGROUND_PITCH
+    // builds without threads track the pitch on the audio thread instead
+    if (mode == PITCH_BACKGROUND)
+        mode = PITCH_STREAMING;
+#endif
+    bool analyzing = mode == PITCH_BACKGROUND && !choir;
+    if (analyzing && pitch_analyzer == nullptr && scope_size) {
+        pitch_analyzer = new BackgroundPitchDetector ();
+        pitch_analyzer->start (scope_size, pitch_analyzer_hop);
+    } else if (!analyzing) {
+        delete pitch_analyzer;
+        pitch_analyzer = nullptr;
+    }
+    pitch_detection = mode;
+}
+
 double Nanceloid::get_frequency () {
     return frequency;
 }
@@ -61,161 +112,229 @@ double Nanceloid::get_voicing () {
 }
 
 void Nanceloid::run (float *out) {
-    // run super samples
-    // TODO: fix super samples whe its > 1 ????
-    double output = 0;
-    for (int i = 0; i < super_sampling; i++) {
-        // run control rate operations
-        if (clock++ % control_rate_divider == 0)
-            run_control ();
+    render (out, out + 1, 2, 1);
+}
+
+void Nanceloid::run_block (float *left, float *right, int frames) {
+    render (left, right, 1, frames);
+}
+
+void Nanceloid::run_interleaved (float *out, int frames) {
+    render (out, out + 1, 2, frames);
+}
+
+void Nanceloid::render (float *left, float *right, int stride, int frames) {
+    STAGE_START ();
+    STAGE_SAMPLES (frames);
+    while (frames > 0) {
+        // simulate a block and bring it to the host rate
+        int block = min (frames, render_block);
+        double pan = params.panning.get_normalized_value () / 2;
+        left_gain.set_target (cos (pan * M_PI), block);
+        right_gain.set_target (sin (pan * M_PI), block);
+        const double *output = simulated;
+        if (resampling) {
+            simulate (simulated, resampler.get_input_needed (block));
+            resampler.process (simulated, resampled, block);
+            output = resampled;
+            STAGE_LAP (STAGE_RESAMPLE);
+        } else {
+            simulate (simulated, block);
+        }
+
+        for (int i = 0; i < block; i++) {
+            *left = left_gain.next () * output[i];
+            *right = right_gain.next () * output[i];
+            left += stride;
+            right += stride;
+        }
+        frames -= block;
+        STAGE_LAP (STAGE_MIX);
+    }
+}
 
-        // cheap filter to smooth pops
-        double weight = 1 / (pressure_smoothing + 1);
-        pressure = (target_pressure * weight + pressure) / (1 + weight);
-
-        // glottal source and uvula
-        const double amp = 0.1;
-        const double damping = 0.1;
-        const double uvula_tract_coupling = 0.5; // uvula couplng to resonator
-        const double fold_coupling_k = 1 * cord_tension / 2;
-        const double n = 10;
-        const double nd = 5;
-        const double uvula = params.uvula.value;
-        const double fold_2_c = params.second_fold.value; // how present the second simulated fold is
-        const double uvula_frequency = 100;
-        const double uvula_tension = pow (uvula_frequency * 2 * M_PI, 2.0);
-        double coupling_spring = fold_coupling_k * (x2 - x);
-        // first fold
-        double delta_pressure = pressure + l[0] * params.coupling.value;
-        double a = -cord_tension * (x + n * x * x * x) - damping * (v + nd * v * x * x) * frequency + delta_pressure * amp * cord_tension * (1 + n) + coupling_spring;
-        // second fold
-        double delta_pressure2 = (r[0] + l[1]) * params.coupling.value;
-        double a2 = -cord_tension * (x2 + n * x2 * x2 * x2) - damping * (v2 + nd * v2 * x2 * x2) * frequency + delta_pressure2 * amp * cord_tension * (1 + n) - coupling_spring;
-        // uvula
-        int ui = mouth_i + 1;
-        double delta_pressure3 = (r[ui] + l[ui + 1]) * uvula_tract_coupling;
-        double a3 = -uvula_tension * (x3 + n * x3 * x3 * x3) - damping * (v3 + nd * v3 * x3 * x3) * uvula_frequency + delta_pressure3 * amp * uvula_tension * (1 + n);
-        // integrate
-        v  += a  * dt;
-        v2 += a2 * dt;
-        v3 += a3 * dt;
-        x  += v  * dt;
-        x2 += v2 * dt;
-        x3 += v3 * dt;
-        // update waveguide
-        // first fold
-        shape.set_sample (0, fmax (0, x));
-        // second fold
-        double i2 = 1.0 / (waveguide_length - 1);
-        double x2_ = (shape.sample (i2) + x2 * fold_2_c) / (1 + fold_2_c);
-        shape.set_sample (i2, fmax (0, x2_));
-        // uvula
-        double i3 = (double) ui / (waveguide_length - 1);
-        double x3_ = shape.sample (i3) + x3 * uvula;
-        shape.set_sample (i3, fmax (0, x3_));
-        // update reflection coefficients
-        double z0 = get_impedance (0);
-        double z1 = get_impedance (1);
-        double z2 = get_impedance (2);
-        double zu0 = get_impedance (ui);
-        double zu1 = get_impedance (ui + 1);
-        r_junction[0] = z1 > max_impedance ? 1 : (z1 - z0) / (z1 + z0);
-        l_junction[1] = z0 > max_impedance ? 1 : (z0 - z1) / (z0 + z1);
-        r_junction[1] = z2 > max_impedance ? 1 : (z2 - z1) / (z2 + z1);
-        l_junction[2] = z1 > max_impedance ? 1 : (z1 - z2) / (z1 + z2);
-        r_junction[ui]     = zu1 > max_impedance ? 1 : (zu1 - zu0) / (zu1 + zu0);
-        l_junction[ui + 1] = zu0 > max_impedance ? 1 : (zu0 - zu1) / (zu0 + zu1);
-        // glottal output
-        double disp = pow (x + 1 - voicing, 2.0) * M_PI;
-        double glottal_output = pressure * disp;
-
-        // update ends of waveguide
-        int end = waveguide_length - 1;
-        int nose_end = nose_length - 1;
-        r_[0]   = l[0]   * l_junction[0] + glottal_output;
-        l_[end] = r[end] * r_junction[end];
-        nl_[nose_end] = nr[nose_end] * params.refl_right.value;
-
-        // update nose throat mouth junction
-        double refl_c = 1 - reflection_damping;
-        double throat_out = r[throat_i];
-        double mouth_out = l[mouth_i];
-        double nose_out = nl[0];
-        double throat_refl = throat_refl_c * throat_out;
-        double mouth_refl = mouth_refl_c * mouth_out;
-        double nose_refl = nose_refl_c * nose_out;
-        double throat_trans = throat_out - throat_refl;
-        double mouth_trans = mouth_out - mouth_refl;
-        double nose_trans = nose_out - nose_refl;
-        double throat_to_mouth = throat_to_mouth_w * throat_trans;
-        double throat_to_nose = throat_to_nose_w * throat_trans;
-        double mouth_to_throat = mouth_to_throat_w * mouth_trans;
-        double mouth_to_nose = mouth_to_nose_w * mouth_trans;
-        double nose_to_throat = nose_to_throat_w * nose_trans;
-        double nose_to_mouth = nose_to_mouth_w * nose_trans;
-        double throat_in = mouth_to_throat + nose_to_throat + throat_refl * refl_c;
-        double mouth_in = throat_to_mouth + nose_to_mouth + mouth_refl * refl_c;
-        double nose_in = throat_to_nose + mouth_to_nose + nose_refl * refl_c;
-        l_[throat_i] = throat_in;
-        r_[mouth_i] = mouth_in;
-        nr_[0] = nose_in;
-
-        // update mouth and throat
-        for (int j = 0; j < waveguide_length - 1; j++) {
-            // skip the nose throat mouth junction
-            // since it was handled up there
-            if (j == throat_i)
-                continue;
-            int j0 = j;
-            int j1 = j + 1;
-            double r_refl = r[j0] * r_junction[j0];
-            double l_refl = l[j1] * l_junction[j1];
-            // TODO: flow turbelence
-            double r_turb = 0;
-            double l_turb = 0;
-            //double r_turb = fmax (0, r_refl) * params.turbulence.value * noise ();
-            //double l_turb = fmax (0, l_refl) * params.turbulence.value * noise ();
-            r_[j1] = clip (r[j0] - r_refl + l_refl * refl_c + l_turb);
-            l_[j0] = clip (l[j1] - l_refl + r_refl * refl_c + r_turb);
+void Nanceloid::simulate (double *out, int count) {
+    while (count > 0) {
+        // simulate up to the next control tick without checking the clock
+        int phase = clock % control_rate_divider;
+        int block = min (count, control_rate_divider - phase);
+
+        // run control rate operations at the start of each control period,
+        // counting the sample that starts it first so envelopes see the same
+        // clock as when it was advanced one sample at a time
+        int counted = 0;
+        if (phase == 0) {
+            STAGE_LAP (STAGE_MIX);
+            clock++;
+            counted = 1;
+            run_control ();
         }
-        // update nose
-        for (int j = 0; j < nose_length - 1; j++) {
-            int j0 = j;
-            int j1 = j + 1;
-            nr_[j1] = clip (nr[j0]);
-            nl_[j0] = clip (nl[j1]);
+
+        // the choir renders all of its voices for the whole sub block at once
+        const double *choir_output = nullptr;
+        if (choir) {
+            choir_output = choir->run (block);
+            STAGE_LAP (STAGE_CHOIR);
         }
 
-        // swap buffers
-        double *r__ = r;
-        double *l__ = l;
-        r = r_;
-        l = l_;
-        r_ = r__;
-        l_ = l__;
-        double *nr__ = nr;
-        double *nl__ = nl;
-        nr = nr_;
-        nl = nl_;
-        nr_ = nr__;
-        nl_ = nl__;
-
-        // accumulate sound output from right end of waveguide
-        double mouth_radiance = 1 - r_junction[end];
-        double nose_radiance = 1 - params.refl_right.value;
-        double mouth_output = r[end] * mouth_radiance;
-        double nose_output = nr[nose_end] * nose_radiance;
-        output += (mouth_output + nose_output);
+        for (int i = 0; i < block; i++) {
+            double output = choir_output ? choir_output[i] : run_tract ();
+
+            // mix the samples
+            sample = (output * volume.next () + sample) / 2;    // cheap filter
+            scope[scope_i++] = sample;
+            if (scope_i == scope_size)
+                scope_i = 0;
+            // the choir detects the pitch of each voice itself
+            if (choir_output == nullptr) {
+                if (pitch_detection == PITCH_STREAMING && pitch_tracker.push (sample))
+                    detected_frequency = get_frequency_of_period (pitch_tracker.get_period (), pitch_tracker.get_level ());
+                else if (pitch_analyzer)
+                    pitch_analyzer->push (sample);
+            }
+            out[i] = sample;
+        }
+        out += block;
+        clock += block - counted;
+        count -= block;
+        STAGE_LAP (STAGE_MIX);
     }
+}
+
+double Nanceloid::run_tract () {
+    // everything since the last sample went into mixing it
+    STAGE_LAP (STAGE_MIX);
 
-    // mix and return the samples
-    double target_sample = output / super_sampling * params.volume.value;   // output volume
-    double pan = params.panning.get_normalized_value () / 2;                // panning
-    sample = (target_sample + sample) / 2;                                  // cheap filter
-    scope[scope_i++] = sample;
-    scope_i %= scope_size;
-    out[0] = cos (pan * M_PI) * sample;
-    out[1] = sin (pan * M_PI) * sample;
+    // segments longer than a sample deliver the waves that left their junctions a while ago
+    if (segment_delay > 1) {
+        r_delay.read (r, waveguide_length);
+        l_delay.read (l, waveguide_length);
+    }
+    STAGE_LAP (STAGE_SCATTER);
+
+    const Coefficients &c = coefficients;
+
+    // cheap filter to smooth pops
+    double weight = c.pressure_weight;
+    pressure = (target_pressure * weight + pressure) / (1 + weight);
+
+    // glottal source and uvula
+    const double amp = 0.1;
+    const double damping = 0.1;
+    const double uvula_tract_coupling = 0.5; // uvula couplng to resonator
+    const double n = 10;
+    const double nd = 5;
+    const double uvula_frequency = 100;
+    const double uvula_tension = c.uvula_tension;
+    const double tract_coupling = coupling.next ();
+    double coupling_spring = c.fold_coupling_k * (x2 - x);
+    // first fold
+    double delta_pressure = pressure + l[0] * tract_coupling;
+    double a = -cord_tension * (x + n * x * x * x) - damping * (v + nd * v * x * x) * frequency + delta_pressure * amp * cord_tension * (1 + n) + coupling_spring;
+    // second fold
+    double delta_pressure2 = (r[0] + l[1]) * tract_coupling;
+    double a2 = -cord_tension * (x2 + n * x2 * x2 * x2) - damping * (v2 + nd * v2 * x2 * x2) * frequency + delta_pressure2 * amp * cord_tension * (1 + n) - coupling_spring;
+    // uvula
+    int ui = mouth_i + 1;
+    double delta_pressure3 = (r[ui] + l[ui + 1]) * uvula_tract_coupling;
+    double a3 = -uvula_tension * (x3 + n * x3 * x3 * x3) - damping * (v3 + nd * v3 * x3 * x3) * uvula_frequency + delta_pressure3 * amp * uvula_tension * (1 + n);
+    // integrate
+    v  += a  * dt;
+    v2 += a2 * dt;
+    v3 += a3 * dt;
+    x  += v  * dt;
+    x2 += v2 * dt;
+    x3 += v3 * dt;
+    STAGE_LAP (STAGE_FOLDS);
+    // update waveguide
+    // first fold
+    shape.set_sample (0, fmax (0, x));
+    // second fold
+    double i2 = 1.0 / (waveguide_length - 1);
+    double x2_ = (shape.sample (i2) + x2 * c.fold_2_c) / (1 + c.fold_2_c);
+    shape.set_sample (i2, fmax (0, x2_));
+    // uvula
+    double i3 = (double) ui / (waveguide_length - 1);
+    double x3_ = shape.sample (i3) + x3 * c.uvula;
+    shape.set_sample (i3, fmax (0, x3_));
+    // update reflection coefficients
+    double z0 = get_impedance (sample_shape (0));
+    double z1 = get_impedance (sample_shape (1));
+    double z2 = get_impedance (sample_shape (2));
+    double zu0 = get_impedance (sample_shape (ui));
+    double zu1 = get_impedance (sample_shape (ui + 1));
+    r_junction[0] = z1 > max_impedance ? 1 : (z1 - z0) / (z1 + z0);
+    l_junction[1] = z0 > max_impedance ? 1 : (z0 - z1) / (z0 + z1);
+    r_junction[1] = z2 > max_impedance ? 1 : (z2 - z1) / (z2 + z1);
+    l_junction[2] = z1 > max_impedance ? 1 : (z1 - z2) / (z1 + z2);
+    r_junction[ui]     = zu1 > max_impedance ? 1 : (zu1 - zu0) / (zu1 + zu0);
+    l_junction[ui + 1] = zu0 > max_impedance ? 1 : (zu0 - zu1) / (zu0 + zu1);
+    STAGE_LAP (STAGE_JUNCTIONS);
+    // glottal output
+    double opening = x + 1 - voicing;
+    double glottal_output = pressure * (opening * opening * M_PI);
+
+    // everything is updated in place so the waves entering the ends and the nose throat mouth junction
+    // are worked out first and only written once the scattering has read the old waves there
+    // ends of waveguide
+    int end = waveguide_length - 1;
+    double r_start = l[0] * l_junction[0] + glottal_output;
+    double l_end = r[end] * r_junction[end];
+    double nl_end = clip_wave (nr[nose_i]) * c.refl_right;
+
+    // nose throat mouth junction
+    double refl_c = c.refl_c;
+    double throat_out = r[throat_i];
+    double mouth_out = l[mouth_i];
+    double nose_out = clip_wave (nl[nose_i]);
+    double throat_refl = throat_refl_c * throat_out;
+    double mouth_refl = mouth_refl_c * mouth_out;
+    double nose_refl = nose_refl_c * nose_out;
+    double throat_trans = throat_out - throat_refl;
+    double mouth_trans = mouth_out - mouth_refl;
+    double nose_trans = nose_out - nose_refl;
+    double throat_to_mouth = throat_to_mouth_w * throat_trans;
+    double throat_to_nose = throat_to_nose_w * throat_trans;
+    double mouth_to_throat = mouth_to_throat_w * mouth_trans;
+    double mouth_to_nose = mouth_to_nose_w * mouth_trans;
+    double nose_to_throat = nose_to_throat_w * nose_trans;
+    double nose_to_mouth = nose_to_mouth_w * nose_trans;
+    double throat_in = mouth_to_throat + nose_to_throat + throat_refl * refl_c;
+    double mouth_in = throat_to_mouth + nose_to_mouth + mouth_refl * refl_c;
+    double nose_in = throat_to_nose + mouth_to_nose + nose_refl * refl_c;
+    STAGE_LAP (STAGE_NOSE_JUNCTION);
+
+    // update mouth and throat
+    // either side of the nose throat mouth junction since it was handled up there
+    // TODO: flow turbelence
+    //double r_turb = fmax (0, r_refl) * params.turbulence.value * noise ();
+    //double l_turb = fmax (0, l_refl) * params.turbulence.value * noise ();
+    scatter (r, l, r_junction, l_junction, 0, throat_i, refl_c);
+    scatter (r, l, r_junction, l_junction, mouth_i, waveguide_length - 1, refl_c);
+
+    // now the new waves can go in
+    r[0] = r_start;
+    l[end] = l_end;
+    l[throat_i] = throat_in;
+    r[mouth_i] = mouth_in;
+    if (segment_delay > 1) {
+        r_delay.write (r, waveguide_length);
+        l_delay.write (l, waveguide_length);
+    }
+    STAGE_LAP (STAGE_SCATTER);
+
+    // the nose is just a delay so its new waves replace the ones that came out of each end
+    nl[nose_i] = nl_end;
+    nr[nose_i] = nose_in;
+    if (++nose_i == nose_delay)
+        nose_i = 0;
+
+    // accumulate sound output from right end of waveguide
+    double mouth_radiance = 1 - r_junction[end];
+    double mouth_output = r[end] * mouth_radiance;
+    double nose_output = clip_wave (nr[nose_i]) * c.nose_radiance;
+    STAGE_LAP (STAGE_NOSE);
+    return mouth_output + nose_output;
 }
 
 void Nanceloid::run_control () {
@@ -227,7 +346,85 @@ void Nanceloid::run_control () {
     vibrato_osc = sin (vibrato_phase * M_PI * 2) * params.vibrato_depth.value;
     vibrato_phase += params.vibrato_rate.value / control_rate;
 
-    target_pressure = 0;
+    // run adsr envelope to get current input pressure
+    target_pressure = get_envelope (note);
+
+    // crossfade voicing
+    voicing += (params.voicing.value - voicing) * params.crossfade.value;
+    STAGE_LAP (STAGE_CONTROL);
+
+    // pitch detection via auto correlation
+    // streaming detection has already been kept up to date every sample
+    // the choir detects the pitch of each voice itself
+    if (choir) {
+        detected_frequency = 0;
+    } else if (pitch_detection == PITCH_BACKGROUND) {
+        // use whatever the analysis thread found most recently
+        BackgroundPitchDetector::Estimate estimate = pitch_analyzer ? pitch_analyzer->get_estimate () : BackgroundPitchDetector::Estimate {0, 0};
+        detected_frequency = get_frequency_of_period (estimate.period, estimate.level);
+    } else if (pitch_detection == PITCH_BATCH) {
+        // the window starts at the oldest sample in the scope
+        int max_peak_i = pitch_detector.detect (scope, scope_i);
+        detected_frequency = get_frequency_of_period (max_peak_i, scope_max);
+        scope_max = 0;
+        for (int i = 0; i < scope_size; i++)
+            if (scope[i] > scope_max)
+                scope_max = scope[i];
+    }
+    STAGE_LAP (STAGE_AUTOCORRELATION);
+
+    // update target frequency
+    frequency += (get_target_frequency (note) - frequency) * params.portamento.value;
+
+    // pitch correction
+    cord_tension = correct_pitch (frequency, detected_frequency, error);
+
+    // follow changes to the tract length and junctions
+    if (params.tract_length.value != tract_length || (int) params.junctions.value != junctions)
+        resize ();
+
+    STAGE_LAP (STAGE_CONTROL);
+
+    // update shape
+    crossfade_shape ();
+    STAGE_LAP (STAGE_CROSSFADE);
+    update_reflections ();
+    STAGE_LAP (STAGE_REFLECTIONS);
+    update_coefficients ();
+
+    // the voices of the choir follow the shape and lfos updated above
+    if (choir)
+        choir->run_control ();
+    STAGE_LAP (STAGE_CONTROL);
+}
+
+void Nanceloid::update_coefficients (bool immediately) {
+    Coefficients &c = coefficients;
+    const double uvula_frequency = 100;
+    c.pressure_weight = 1 / (pressure_smoothing + 1);
+    c.uvula_tension = pow (uvula_frequency * 2 * M_PI, 2.0);
+    c.fold_coupling_k = 1 * cord_tension / 2;
+    c.uvula = params.uvula.value;
+    c.fold_2_c = params.second_fold.value;
+    c.refl_c = 1 - reflection_damping;
+    c.refl_right = params.refl_right.value;
+    c.nose_radiance = 1 - params.refl_right.value;
+
+    // ramp over the control period to the new values
+    double pan = params.panning.get_normalized_value () / 2;
+    if (immediately) {
+        volume.set (params.volume.value);
+        coupling.set (params.coupling.value);
+        left_gain.set (cos (pan * M_PI));
+        right_gain.set (sin (pan * M_PI));
+    } else {
+        volume.set_target (params.volume.value, control_rate_divider);
+        coupling.set_target (params.coupling.value, control_rate_divider);
+    }
+}
+
+double Nanceloid::get_envelope (Note &note) {
+    double pressure = 0;
     if (note.note) {
 
         // run adsr envelope to get current input pressure
@@ -239,77 +436,27 @@ void Nanceloid::run_control () {
 
         if (delta_time < params.adsr_attack.value)
             // attack
-            target_pressure = note.start_pressure + (1 - note.start_pressure) * delta_time / params.adsr_attack.value;
+            pressure = note.start_pressure + (1 - note.start_pressure) * delta_time / params.adsr_attack.value;
         else if (delta_time < params.adsr_attack.value + params.adsr_decay.value)
             // decay
-            target_pressure = 1 - (1 - sustain) * (delta_time - params.adsr_attack.value) / params.adsr_decay.value;
+            pressure = 1 - (1 - sustain) * (delta_time - params.adsr_attack.value) / params.adsr_decay.value;
         else if (note.on)
             // sustain
-            target_pressure = sustain;
+            pressure = sustain;
         else if (delta_time < off_time + params.adsr_release.value)
             // release
-            target_pressure = sustain - sustain * (delta_time - off_time) / params.adsr_release.value;
-    }
-    target_pressure *= note.velocity * (1 - params.min_velocity.value) + params.min_velocity.value;
-
-    // crossfade voicing
-    voicing += (params.voicing.value - voicing) * params.crossfade.value;
-
-    // pitch detection via auto correlation
-    // calculate auto correlation
-    // also find peaks
-    auto_correlation_max = 0;
-    int max_peak_i = 0;
-    bool last_was_down = false;
-    double new_scope_max = 0;
-    for (int i = 0; i < scope_size; i++) {
-        // find auto correlation value at lag = i
-        double s = 0;
-        for (int j = 0; j < scope_size; j++) {
-            int j2 = j - i;
-            if (j2 >= 0) {
-                double s0 = scope[j];
-                double s1 = scope[j2];
-                s += s0 * s1;
-            }
-        }
-        auto_correlation[i] = s;
-
-        // find scope max while we r at it
-        if (scope[i] > new_scope_max)
-            new_scope_max = scope[i];
-
-        // find max sample for normalization later
-        if (s > auto_correlation_max)
-            auto_correlation_max = s;
-
-        // find peaks
-        bool down = true;
-        if (i > 0) {
-            double last_s = auto_correlation[i - 1];
-            down = s < last_s;
-        }
-        if (down && !last_was_down) {
-            // found a peak at i
-            // ignore i = 0 because thats the first peak and we are looking for the second local maximum
-            if (i > 0 && (max_peak_i == 0 || s > auto_correlation[max_peak_i]))
-                max_peak_i = i;
-        }
-        last_was_down = down;
+            pressure = sustain - sustain * (delta_time - off_time) / params.adsr_release.value;
     }
-    // calculate pitch by period between local maximums of auto correlation
-    if (scope_max > epsilon)
-        detected_frequency = max_peak_i ? (double) rate / max_peak_i / 2 : 0;
-    else
-        detected_frequency = 0;
-    scope_max = new_scope_max;
+    return pressure * (note.velocity * (1 - params.min_velocity.value) + params.min_velocity.value);
+}
 
-    // update target frequency
-    double semitones = note.note + note.detune + vibrato_osc;
-    double target_frequency = 440 * pow (2.0, (semitones - 69) / 12);
-    frequency += (target_frequency - frequency) * params.portamento.value;
+double Nanceloid::get_target_frequency (Note &note) {
+    // pitch bend is shared by all notes
+    double semitones = note.note + this->note.detune + vibrato_osc;
+    return 440 * pow (2.0, (semitones - 69) / 12);
+}
 
-    // pitch correction
+double Nanceloid::correct_pitch (double frequency, double detected_frequency, double &error) {
     if (detected_frequency) {
         double delta = frequency - detected_frequency;
         if (!(error > frequency * pow (2, params.max_error_scale.value)
@@ -318,48 +465,211 @@ void Nanceloid::run_control () {
     }
     if (detected_frequency == 0)
         error -= error * params.correction.value;
-    cord_tension = pow ((frequency + error * params.correction.value) * 2 * M_PI, 2.0);
+    return pow ((frequency + error * params.correction.value) * 2 * M_PI, 2.0);
+}
 
-    // update shape
-    shape.crossfade (get_shape (), params.crossfade.value);
-    update_reflections ();
+double Nanceloid::noise () {
+    // xorshift64* so every instance has its own sequence
+    noise_state ^= noise_state >> 12;
+    noise_state ^= noise_state << 25;
+    noise_state ^= noise_state >> 27;
+    return (noise_state * 0x2545f4914f6cdd1dULL >> 11) * (1.0 / 9007199254740992.0);
+}
+
+void Nanceloid::set_seed (uint64_t seed) {
+    // mix the seed so small seeds don't start with tiny values and 0 is still usable
+    noise_state = seed * 0x9e3779b97f4a7c15ULL + 0x632be59bd9b4e019ULL;
+    if (noise_state == 0)
+        noise_state = 1;
+}
+
+double Nanceloid::get_frequency_of_period (int period, double level) {
+    // calculate pitch by period between local maximums of auto correlation
+    if (level > epsilon)
+        return period ? (double) rate / period / 2 : 0;
+    return 0;
 }
 
 void Nanceloid::init () {
     // free old waveguide
     free ();
 
-    // calculate number of segments based on desired length
+    // size everything for the longest tract so the length can change without reallocating
     // +2 for the 2 vocal fold segments
-    waveguide_length = (int) floor (params.tract_length.value * rate / speed_of_sound) + 2;
-    nose_length = waveguide_length / 2;
+    max_waveguide_length = max (min_segments, (int) floor (params.tract_length.max * rate / speed_of_sound) + 2);
+    max_nose_length = max_waveguide_length / 2;
+
+    // the scope covers the same amount of time at any rate
+    scope_size = (int) round (rate * scope_duration);
+    scope_i = 0;
+
+    // carve all the arrays out of one block each starting on its own cache line
+    const int per_line = cache_line / sizeof (wave);
+    int tract_stride = (max_waveguide_length + per_line - 1) / per_line * per_line;
+    int nose_stride = (max_nose_length + per_line - 1) / per_line * per_line;
+    int scope_stride = (scope_size + per_line - 1) / per_line * per_line;
+    arena_length = tract_stride * 4 + nose_stride * 2 + scope_stride;
+    arena = (wave *) operator new (arena_length * sizeof (wave), align_val_t (cache_line));
+    wave *next = arena;
+    for (wave **array : {&r, &l, &r_junction, &l_junction}) {
+        *array = next;
+        next += tract_stride;
+    }
+    for (wave **array : {&nr, &nl}) {
+        *array = next;
+        next += nose_stride;
+    }
+    scope = next;
+
+    // render buffers with room for the most simulated samples a block of host frames can need
+    simulated = new double[(int) ceil (render_block * rate / host_rate) + 2];
+    resampled = new double[render_block];
+    diameter = new double[max_waveguide_length];
+    impedance = new double[max_waveguide_length];
+
+    // room for every saved shape at the most segments
+    shape_cache_arena = new double[max_waveguide_length * 2 * 128];
+    for (int i = 0; i < 128; i++) {
+        shape_caches[i].diameter = shape_cache_arena + max_waveguide_length * 2 * i;
+        shape_caches[i].impedance = shape_caches[i].diameter + max_waveguide_length;
+    }
 
-    // indices of throat and mouth at junction
-    throat_i = waveguide_length - nose_length - 1;
-    mouth_i = throat_i + 1;
+    // pitch detection
+    pitch_detector.init (scope_size);
+    // get_frequency_of_period halves the period so the longest lag needed is half the lowest period
+    pitch_tracker.init (scope_size, (int) ceil (rate / pitch_tracker_lowest / 2) + 1, pitch_tracker_hop);
 
-    // create the new arrays
-    r = new double[waveguide_length];
-    l = new double[waveguide_length];
-    r_ = new double[waveguide_length];
-    l_ = new double[waveguide_length];
-    r_junction = new double[waveguide_length];
-    l_junction = new double[waveguide_length];
-    nr = new double[nose_length];
-    nl = new double[nose_length];
-    nr_ = new double[nose_length];
-    nl_ = new double[nose_length];
-
-    // clear them
-    for (int i = 0; i < waveguide_length; i++) {
-        r[i] = l[i] = r_[i] = l_[i] = r_junction[i] = l_junction[i] = 0;
-    }
-    for (int i = 0; i < nose_length; i++) {
-        nr[i] = nl[i] = nr_[i] = nl_[i] = 0;
+    // segments are longest with the fewest junctions
+    max_segment_delay = (params.tract_length.max * rate / speed_of_sound + 2) / min_junctions;
+    r_delay.init (max_waveguide_length, max_segment_delay);
+    l_delay.init (max_waveguide_length, max_segment_delay);
+
+    clear ();
+
+    // the choir uses the same dimensions
+    if (choir)
+        choir->init ();
+}
+
+void Nanceloid::clear () {
+    for (int i = 0; i < arena_length; i++)
+        arena[i] = 0;
+    scope_i = 0;
+    shape.mark_changed ();
+    for (ShapeCache &cache : shape_caches)
+        cache.valid = false;
+
+    // pitch detection and resampling start from silence too
+    pitch_tracker.reset ();
+    // the analysis thread keeps running unless the window has to change size
+    if (pitch_detection == PITCH_BACKGROUND && !choir) {
+        if (pitch_analyzer == nullptr)
+            pitch_analyzer = new BackgroundPitchDetector ();
+        if (pitch_analyzer->is_running () && pitch_analyzer->get_size () == scope_size)
+            pitch_analyzer->reset ();
+        else
+            pitch_analyzer->start (scope_size, pitch_analyzer_hop);
     }
+    if (resampling)
+        resampler.reset ();
+    r_delay.clear ();
+    l_delay.clear ();
+
+    // use the current tract length
+    waveguide_length = nose_length = nose_delay = nose_i = 0;
+    segment_delay = 1;
+    resize ();
 
     // precalculate reflection coefficients
     update_reflections ();
+    update_coefficients (true);
+}
+
+void Nanceloid::reset () {
+    // everything a new instance starts with
+    for (TractShape &shape : shapes)
+        shape = TractShape ();
+    shape_i = 0;
+    params = Parameters ();
+    note = Note ();
+    coefficients = Coefficients ();
+    clock = 0;
+    sample = 0;
+    tremolo_phase = vibrato_phase = 0;
+    tremolo_osc = vibrato_osc = 0;
+    frequency = target_pressure = pressure = voicing = cord_tension = 0;
+    sync_scope_samples = sync_scope_i = 0;
+    scope_max = 0;
+    detected_frequency = 1;
+    error = 0;
+    set_seed (0);
+    x = x2 = x3 = v = v2 = v3 = 0;
+    shape = TractShape ();
+
+    if (rate == 0)
+        return;
+    clear ();
+    if (choir)
+        choir->reset ();
+}
+
+void Nanceloid::resize () {
+    // calculate number of segments based on desired length
+    // +2 for the 2 vocal fold segments
+    tract_length = params.tract_length.value;
+    junctions = (int) params.junctions.value;
+    double delay = tract_length * rate / speed_of_sound + 2;
+    // short tracts at low rates still need room for the uvula after the mouth
+    int length = max (min_segments, min (max_waveguide_length, (int) floor (delay)));
+
+    // with fewer junctions than that each segment delays by more than a sample
+    // so the cost no longer grows with the rate
+    double new_segment_delay = 1;
+    if (junctions > 0 && max (min_junctions, junctions) < length) {
+        length = max (min_junctions, junctions);
+        new_segment_delay = delay / length;
+    }
+    int nose = length / 2;
+    int new_nose_delay = min (max_nose_length, (int) round (nose * new_segment_delay));
+    bool was_fractional = segment_delay > 1;
+    bool fractional = new_segment_delay > 1;
+
+    if (length != waveguide_length && (fractional || was_fractional)) {
+        // segments of a different size can't carry on from the old waves
+        for (int i = 0; i < max_waveguide_length; i++)
+            r[i] = l[i] = 0;
+    } else {
+        // silence whatever falls off the end so growing again later starts from silence
+        for (int i = length; i < waveguide_length; i++) {
+            r[i] = l[i] = r_junction[i] = l_junction[i] = 0;
+        }
+    }
+    if (fractional && (length != waveguide_length || !was_fractional)) {
+        r_delay.reset (r, length);
+        l_delay.reset (l, length);
+    }
+    if (fractional) {
+        r_delay.set_delay (new_segment_delay);
+        l_delay.set_delay (new_segment_delay);
+    }
+    if (new_nose_delay != nose_delay) {
+        resize_delay (nr, nl, nose_i, nose_delay, new_nose_delay);
+        nose_i = 0;
+    }
+    // the segments sample the shapes in different places
+    if (length != waveguide_length) {
+        shape.mark_changed ();
+        for (ShapeCache &cache : shape_caches)
+            cache.valid = false;
+    }
+    waveguide_length = length;
+    nose_length = nose;
+    nose_delay = new_nose_delay;
+    segment_delay = new_segment_delay;
+
+    // indices of throat and mouth at junction
+    throat_i = waveguide_length - nose_length - 1;
+    mouth_i = throat_i + 1;
 }
 
 TractShape &Nanceloid::get_shape () {
@@ -374,38 +684,86 @@ void Nanceloid::set_shape_id (int id) {
     shape_i = id;
 }
 
-double Nanceloid::get_impedance (int i) {
-    double n = (double) i / (waveguide_length - 1);
-    double diameter = shape.sample (n);
+double Nanceloid::get_diameter (double n) {
+    return shape.sample (n);
+}
+
+double Nanceloid::get_velic_closure () {
+    return shape.velic_closure;
+}
+
+double Nanceloid::get_impedance (double diameter) {
     double radius = diameter / 2;
     double area = radius * radius * M_PI;
     return 1 / (area + epsilon);
 }
 
-void Nanceloid::update_reflections () {
-    // calculate the segment impedances
-    double impedance[waveguide_length];
-    for (int i = 0; i < waveguide_length; i++) {
-        impedance[i] = get_impedance (i);
+Nanceloid::ShapeCache &Nanceloid::get_shape_cache () {
+    TractShape &shape = get_shape ();
+    ShapeCache &cache = shape_caches[shape_i];
+    if (!cache.valid || shape.is_changed ()) {
+        shape.clear_changed ();
+        shape.resample (cache.diameter, waveguide_length);
+        for (int i = 0; i < waveguide_length; i++)
+            cache.impedance[i] = get_impedance (cache.diameter[i]);
+        cache.valid = true;
     }
-    // calculate right going coefficients
-    for (int i = 0; i < waveguide_length - 1; i++) {
-        double z0 = impedance[i];
-        double z1 = impedance[i + 1];
-        r_junction[i] = z1 > max_impedance ? 1 : (z1 - z0) / (z1 + z0);
-    }
-    // calculate left going coefficients
-    for (int i = 1; i < waveguide_length; i++) {
-        double z0 = impedance[i];
-        double z1 = impedance[i - 1];
-        l_junction[i] = z1 > max_impedance ? 1 : (z1 - z0) / (z1 + z0);
+    return cache;
+}
+
+double Nanceloid::sample_shape (int i) {
+    return shape.sample ((double) i / (waveguide_length - 1));
+}
+
+void Nanceloid::crossfade_shape () {
+    shape.crossfade (get_shape (), params.crossfade.value);
+}
+
+void Nanceloid::update_reflections () {
+    // a segment samples the shape between the 2 points either side of it
+    // so only segments within a point of a moved point can have a new impedance
+    ShapeCache &target = get_shape_cache ();
+    double segments_per_point = (double) (waveguide_length - 1) / (TractShape::length - 1);
+    uint64_t changed = shape.get_changed ();
+    shape.clear_changed ();
+    reflections_begin = waveguide_length;
+    reflections_end = 0;
+    int next = 0;   // first segment not recalculated yet
+    while (changed) {
+        int point = __builtin_ctzll (changed);
+        changed &= changed - 1;
+        int begin = max (next, (int) floor ((point - 1) * segments_per_point));
+        int end = min (waveguide_length - 1, (int) ceil ((point + 1) * segments_per_point));
+        if (begin > end)
+            continue;
+        next = end + 1;
+        // calculate the segment impedances
+        // segments that settled on the saved shape take its impedance as is
+        for (int i = begin; i <= end; i++) {
+            diameter[i] = sample_shape (i);
+            impedance[i] = diameter[i] == target.diameter[i] ? target.impedance[i] : get_impedance (diameter[i]);
+        }
+        // calculate right going coefficients
+        for (int i = max (0, begin - 1); i < min (waveguide_length - 1, end + 1); i++) {
+            double z0 = impedance[i];
+            double z1 = impedance[i + 1];
+            r_junction[i] = z1 > max_impedance ? 1 : (z1 - z0) / (z1 + z0);
+        }
+        // calculate left going coefficients
+        for (int i = max (1, begin); i < min (waveguide_length, end + 2); i++) {
+            double z0 = impedance[i];
+            double z1 = impedance[i - 1];
+            l_junction[i] = z1 > max_impedance ? 1 : (z1 - z0) / (z1 + z0);
+        }
+        reflections_begin = min (reflections_begin, max (0, begin - 1));
+        reflections_end = min (waveguide_length, end + 2);
     }
     // update end reflections
     r_junction[waveguide_length - 1] = params.refl_right.value;
     l_junction[0] = params.refl_left.value;
     // throat mouth nose junction reflection coefficients and transmittance weights
-    double throat_z = get_impedance (throat_i);
-    double mouth_z = get_impedance (mouth_i);
+    double throat_z = impedance[throat_i];
+    double mouth_z = impedance[mouth_i];
     double nose_z = 1.0 / (params.nose_admittance.value * (1 - shape.velic_closure) + epsilon);
     double throat_y = 1.0 / throat_z;
     double mouth_y = 1.0 / mouth_z;
@@ -428,6 +786,10 @@ void Nanceloid::update_reflections () {
 }
 
 void Nanceloid::note_on (int note, double velocity) {
+    if (choir) {
+        choir->note_on (note, velocity);
+        return;
+    }
     this->note.note = note;
     this->note.velocity = velocity;
     this->note.on_time = clock;
@@ -436,23 +798,40 @@ void Nanceloid::note_on (int note, double velocity) {
 }
 
 void Nanceloid::note_off (int note) {
-    if (note == this->note.note) {
+    if (choir)
+        choir->note_off (note);
+    else if (note == this->note.note) {
         this->note.off_time = clock;
         this->note.on = false;
     }
 }
 
 int Nanceloid::playing_note () {
+    if (choir)
+        return choir->playing_note ();
     return note.on ? note.note : -1;
 }
 
+void Nanceloid::set_polyphony (int voices) {
+    delete choir;
+    choir = nullptr;
+    if (voices > 1) {
+        choir = new Choir (*this, voices);
+        if (rate)
+            choir->init ();
+    }
+
+    // start or stop the analysis thread for the monophonic voice
+    set_pitch_detection (pitch_detection);
+}
+
 void Nanceloid::midi (uint8_t *data) {
 
     // parse the data
     uint8_t type = data[0] & 0xf0;
-    uint8_t chan = data[0] & 0x0f;
     
 #ifdef DEBUG
+    uint8_t chan = data[0] & 0x0f;
     cout << "Received midi event: 0x" << hex << (int) type << " channel: 0x" << hex << (int) chan << endl;
 #endif
 
@@ -499,7 +878,11 @@ void Nanceloid::midi (uint8_t *data) {
         cout << "Received midi note on event: 0x" << hex << (int) note << " 0x" << hex << (int) velocity << endl;
 #endif
 
-        note_on (note, velocity / 127.0);
+        // a note on without velocity is how running status sends a note off
+        if (velocity == 0)
+            note_off (note);
+        else
+            note_on (note, velocity / 127.0);
 
     } else if (type == 0xe0) {
 
@@ -528,10 +911,10 @@ void Nanceloid::midi (uint8_t *data) {
 void Nanceloid::prepare_scope () {
     if (detected_frequency) {
         // num samples in scape
-        int samples = rate / detected_frequency;
+        int samples = fmin (scope_size, rate / detected_frequency);
         // scan relevant region of scope for min and max samples and their indices
         int j = scope_i - samples;
-        if (j < scope_size)
+        if (j < 0)
             j += scope_size;
         double min = 1000;
         for (int i = 0; i < samples; i++) {
@@ -561,3 +944,9 @@ double Nanceloid::get_scope (double n) {
 int Nanceloid::get_scope_samples () {
     return sync_scope_samples;
 }
+
+#ifdef STAGE_COUNTERS
+StageCounters &Nanceloid::get_stage_counters () {
+    return stage_counters;
+}
+#endif
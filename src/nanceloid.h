@@ -1,24 +1,27 @@
 #pragma once
 
 #include <parameters.h>
+#include <pitch.h>
+#include <delay.h>
+#include <resampler.h>
+#include <stage_counters.h>
 #include <cmath>
 #include <cstdint>
 
 // reperesents a vocal tract shape
 class TractShape {
+    public:
+        static const int length = 32;   // points along the tract
+
     private:
-        double *diameter;   // let range be 0 to 1
-        int length;
+        double diameter[length];    // let range be 0 to 1
+        uint64_t changed = 0;       // a bit for each point moved since the last clear_changed
 
     public:
-        TractShape (int length = 32) : length (length) {
-            diameter = new double[length];
+        TractShape () {
             for (int i = 0; i < length; i++)
                 diameter[i] = 0.5;
-        }
-
-        ~TractShape () {
-            delete diameter;
+            mark_changed ();
         }
 
         // get an interpolate value given a normalized position
@@ -37,67 +40,184 @@ class TractShape {
         // the above but set instead
         void set_sample (double n, double sample) {
             // just set nearest ig lol
-            int i = floor (n * length + 0.5);
+            int i = fmax (0, fmin (length - 1, floor (n * length + 0.5)));
+            if (diameter[i] != sample)
+                changed |= (uint64_t) 1 << i;
             diameter[i] = sample;
         }
 
         // approach a given shape
+        // points within a threshold of the target snap to it so a settled shape stops changing
         void crossfade (TractShape &target, double strength) {
+            const double threshold = 1e-6;
+            if (strength <= 0)
+                return;
             for (int i = 0; i < length; i++) {
-                double position = (double) i / (length - 1);
-                double target_sample = target.sample (position);
-                diameter[i] += (target_sample - diameter[i]) * strength;
+                double distance = target.diameter[i] - diameter[i];
+                if (distance == 0)
+                    continue;
+                if (fabs (distance) < threshold)
+                    diameter[i] = target.diameter[i];
+                else
+                    diameter[i] += distance * strength;
+                changed |= (uint64_t) 1 << i;
             }
             velic_closure += (target.velic_closure - velic_closure) * strength;
         }
 
+        // sample the shape once for each of a number of evenly spaced segments
+        void resample (double *segments, int count) {
+            for (int i = 0; i < count; i++)
+                segments[i] = sample ((double) i / (count - 1));
+        }
+
+        // whether any point moved since the last clear_changed
+        bool is_changed () {
+            return changed != 0;
+        }
+
+        // the points moved since the last clear_changed, one bit each starting from the glottis
+        uint64_t get_changed () {
+            return changed;
+        }
+
+        void clear_changed () {
+            changed = 0;
+        }
+
+        // treat every point as moved
+        void mark_changed () {
+            changed = ((uint64_t) 1 << length) - 1;
+        }
+
         // public members
         double velic_closure = 1;       // closure of the nasal cavity opening
 };
 
+// a value that moves linearly to a target one step at a time so changes don't zipper
+class Ramp {
+    private:
+        double value = 0;
+        double target = 0;
+        double step = 0;
+        int remaining = 0;      // steps until the target is reached
+
+    public:
+        // jump straight to a value
+        void set (double value) {
+            this->value = target = value;
+            remaining = 0;
+        }
+
+        // move to a target over a number of steps
+        void set_target (double target, int steps) {
+            this->target = target;
+            remaining = target == value ? 0 : steps;
+            step = (target - value) / steps;
+        }
+
+        // take a step and get the value
+        // lands exactly on the target so a steady value stays steady
+        double next () {
+            if (remaining > 0)
+                value = --remaining ? value + step : target;
+            return value;
+        }
+
+        // get the value without stepping
+        double get () {
+            return value;
+        }
+};
+
+class Choir;
+class BackgroundPitchDetector;
+
+// precision of the waveguides and scope
+// double precision is the reference and single precision halves their size
+#ifdef SINGLE_PRECISION
+typedef float wave;
+#else
+typedef double wave;
+#endif
+
+// ways of detecting the playing pitch for pitch correction
+enum PitchDetection {
+    PITCH_BATCH,        // auto correlate the whole scope at control rate
+    PITCH_STREAMING,    // track the auto correlation as each sample is output
+    PITCH_BACKGROUND,   // auto correlate the output on a separate thread
+};
+
 // represents a synth instance
 class Nanceloid {
     private:
         // saved tract shapes for each midi patch number
         TractShape shapes[128];
         int shape_i = 0;
+        // each saved shape resampled to a diameter and impedance per segment of the waveguide
+        // rebuilt when the segments or the shape change
+        // segments of the current shape that settled on the saved one take its impedance as is
+        struct ShapeCache {
+            double *diameter = nullptr;
+            double *impedance = nullptr;
+            bool valid = false;
+        };
+        ShapeCache shape_caches[128];
+        double *shape_cache_arena = nullptr;    // one block holding the arrays of every cache
 
         // waveguide stuff
+        wave *arena = nullptr;          // one block holding all the arrays below
+        int arena_length = 0;
+        int max_waveguide_length = 0;   // segments in the longest tract
+        int max_nose_length = 0;
+        double max_segment_delay = 1;   // samples in the longest segment with the fewest junctions
+        double tract_length = 0;        // tract length the current segments were made for
+        int junctions = 0;              // junction setting the current segments were made for
         int waveguide_length = 0;
         int nose_length = 0;
+        int nose_delay = 0;             // samples for a wave to cross the nose
+        double segment_delay = 1;       // samples for a wave to cross a segment
         int throat_i = 0;
         int mouth_i = 0;
         double reflection_damping = 0.01;
         double max_impedance = 1000;
         double epsilon = 0.00001;
-        // right and left going
-        double *r = nullptr;
-        double *l = nullptr;
-        // backbuffers
-        double *r_ = nullptr;
-        double *l_ = nullptr;
+        // right and left going, updated in place every sample
+        wave *r = nullptr;
+        wave *l = nullptr;
+        // the waves that left the junctions when segments are longer than a sample
+        SegmentDelay<wave> r_delay;
+        SegmentDelay<wave> l_delay;
         // reflection coefficients at each junction
-        double *r_junction = nullptr;
-        double *l_junction = nullptr;
+        wave *r_junction = nullptr;
+        wave *l_junction = nullptr;
+        // the current instantaneous shape
+        // the folds and uvula write into it every sample so their movement carries over to the next
+        TractShape shape;
+        // the current shape sampled at each segment as of the last update_reflections
+        double *diameter = nullptr;
+        double *impedance = nullptr;
+        // junctions rewritten by the last update_reflections besides the ends
+        int reflections_begin = 0;
+        int reflections_end = 0;
         // right and left going for the nose
-        double *nr = nullptr;
-        double *nl = nullptr;
-        // backbuffers for the nose
-        double *nr_ = nullptr;
-        double *nl_ = nullptr;
+        // rings of nose_delay that are read and written at nose_i since the nose has no junctions
+        wave *nr = nullptr;
+        wave *nl = nullptr;
+        int nose_i = 0;
         // nose throat mouth junction stuff
-        double throat_refl_c;
-        double mouth_refl_c;
-        double nose_refl_c;
-        double throat_to_mouth_w;
-        double throat_to_nose_w;
-        double mouth_to_throat_w;
-        double mouth_to_nose_w;
-        double nose_to_throat_w;
-        double nose_to_mouth_w;
-
-        // current midi note
-        struct {
+        double throat_refl_c = 0;
+        double mouth_refl_c = 0;
+        double nose_refl_c = 0;
+        double throat_to_mouth_w = 0;
+        double throat_to_nose_w = 0;
+        double mouth_to_throat_w = 0;
+        double mouth_to_nose_w = 0;
+        double nose_to_throat_w = 0;
+        double nose_to_mouth_w = 0;
+
+        // a midi note
+        struct Note {
             double note     = 0;    // midi note value
             double detune   = 0;    // offset in semitones
             double velocity = 0;    // note velocity (0 to 1)
@@ -105,13 +225,45 @@ class Nanceloid {
             int off_time    = 0;    // sample clock time of note off event
             bool on         = 0;    // whether its playing or not
             double start_pressure = 0;  // value at start of adsr
-        } note;                     // info about the current note to play
+        };
+        Note note;                  // info about the current note to play
+
+        // polyphonic voices, only used when polyphony is enabled
+        Choir *choir = nullptr;
+        friend class Choir;
+        friend class Bench;     // microbenchmarks of the private stages
 
         // sampling parameters and timing
-        double rate = 0;            // audio sampling rate
+        double host_rate = 0;       // rate of the output
+        double internal_rate = 0;   // requested simulation rate, 0 to follow the host
+        double rate = 0;            // simulation rate, an exact ratio of the host rate
         double control_rate = 0;    // low frequency control rate
-        int clock = 0;              // sample clock
-        double dt;                  // sampling rate delta time
+        int clock = 0;              // sample clock at the simulation rate
+        double dt = 0;              // sampling rate delta time
+        // conversion from the simulation rate to the host rate
+        Resampler resampler;
+        bool resampling = false;
+        double *simulated = nullptr;    // a block of output at the simulation rate
+        double *resampled = nullptr;    // the same at the host rate
+
+        // values derived from the parameters once per control period
+        // so the simulation only does the arithmetic that actually changes every sample
+        struct Coefficients {
+            double pressure_weight = 0;     // how much of the target pressure is let in each sample
+            double uvula_tension = 0;
+            double fold_coupling_k = 0;     // spring between the 2 folds
+            double uvula = 0;               // how present the uvula is
+            double fold_2_c = 0;            // how present the second simulated fold is
+            double refl_c = 0;              // amount of each reflection that survives damping
+            double refl_right = 0;          // reflection at the nostrils
+            double nose_radiance = 0;
+        };
+        Coefficients coefficients;
+        // parameters that are ramped every sample instead
+        Ramp volume;
+        Ramp coupling;
+        Ramp left_gain;                 // panning at the host rate
+        Ramp right_gain;
 
         // state
         double sample = 0;              // last sample
@@ -128,13 +280,19 @@ class Nanceloid {
         int sync_scope_samples = 0;
         int sync_scope_i = 0;
         int scope_i = 0;
-        static const int scope_size = 1024;
+        int scope_size = 0;             // number of samples in scope
         double scope_max = 0;           // max value in scope
-        double scope[scope_size];
-        double auto_correlation[scope_size];
-        double auto_correlation_max = 1;
+        wave *scope = nullptr;          // ring buffer of recent output
+        PitchDetector pitch_detector;   // finds the period of the scope
+        PitchTracker pitch_tracker;     // finds the period of the output as it is produced
+        BackgroundPitchDetector *pitch_analyzer = nullptr;  // finds the period of the output on another thread
+        PitchDetection pitch_detection = PITCH_BATCH;
         double detected_frequency = 1;  // current detected frequency
         double error = 0;               // frequency error
+#ifdef STAGE_COUNTERS
+        StageCounters stage_counters;   // cycles spent in each part of the synthesis
+#endif
+        uint64_t noise_state = 0x632be59bd9b4e019ULL;   // noise generator as seeded with 0, never 0
         // the masses used for folds etc
         double x = 0;
         double x2 = 0;
@@ -145,9 +303,20 @@ class Nanceloid {
 
         // hardcoded parameters
         const double speed_of_sound = 34300;    // cm/s
-        const int super_sampling = 1;
         const double pressure_smoothing = 100;
         const int control_rate_divider = 1000;  // sample clock divider for low frequency rate
+        const double scope_duration = 1024 / 44100.0;   // seconds of output kept for pitch detection
+        const int pitch_tracker_hop = 32;       // samples between streaming pitch estimates
+        const double pitch_tracker_lowest = 55; // lowest frequency the streaming tracker looks for in hz
+        const int pitch_analyzer_hop = 256;     // samples between background pitch estimates
+        static const int cache_line = 64;       // alignment of the arrays in the arena
+        const int render_block = 256;           // host frames rendered at a time
+        const int max_resampler_phases = 1024;  // internal rates needing more are rounded to a nearby ratio
+        const int min_junctions = 8;            // fewest junctions the junctions parameter can ask for
+        // fewest segments that fit the 2 fold segments, the nose throat mouth junction and the uvula
+        // the nose takes half so the uvula junction after the mouth needs at least 3 segments there
+        const int min_segments = 6;
+        const double min_internal_rate = 4000;  // lower internal rates are raised to this
 
         // free resources
         void free ();
@@ -155,15 +324,62 @@ class Nanceloid {
         // create and initialize the waveguide
         void init ();
 
-        // get the impedance given the index of the waveguide segment
-        double get_impedance (int i);
+        // silence the waveguides and restart the simulation from the current shape
+        // using the buffers init already allocated
+        void clear ();
 
-        // precalculate the reflection coefficients for each junction
+        // set the simulation rate from the host and internal rates
+        void update_rate ();
+
+        // update the number of segments and their delay to the current tract length and junctions
+        void resize ();
+
+        // get the impedance of a segment given its diameter
+        double get_impedance (double diameter);
+
+        // sample the current shape at the position of a segment
+        double sample_shape (int i);
+
+        // get the current saved shape resampled to the segments
+        ShapeCache &get_shape_cache ();
+
+        // move the current shape toward the saved one
+        void crossfade_shape ();
+
+        // precalculate the reflection coefficients for the junctions around the points of the shape that moved
         void update_reflections ();
 
         // runs at control rate
         void run_control ();
 
+        // derive the coefficients and ramp targets from the parameters
+        // immediately jumps to the targets instead of ramping
+        void update_coefficients (bool immediately = false);
+
+        // get a random value from 0 to 1 from the noise generator of this instance
+        double noise ();
+
+        // get the frequency of a detected period given the level of the signal
+        double get_frequency_of_period (int period, double level);
+
+        // get the input pressure from the adsr envelope of a note
+        double get_envelope (Note &note);
+
+        // get the frequency a note should be playing with pitch bend and vibrato
+        double get_target_frequency (Note &note);
+
+        // get the vocal fold tension that corrects a frequency given the detected frequency
+        double correct_pitch (double frequency, double detected_frequency, double &error);
+
+        // run one step of the simulation and return the radiated output
+        double run_tract ();
+
+        // run the simulation for count samples at the simulation rate
+        void simulate (double *out, int count);
+
+        // render frames into left and right buffers advancing each by stride
+        void render (float *left, float *right, int stride, int frames);
+
     public:
         Nanceloid () {};
         ~Nanceloid () ;
@@ -171,9 +387,32 @@ class Nanceloid {
         // update the sample rate
         void set_rate (double rate);
 
+        // run the simulation at a different rate than the host and resample its output
+        // lower rates are cheaper and higher ones keep stiff high pitched folds stable
+        // 0 runs at the host rate, restarts the voice like set_rate
+        // rates below min_internal_rate are raised to it
+        void set_internal_rate (double rate);
+
+        // get the rate the simulation is actually running at
+        double get_internal_rate ();
+
+        // get the delay added by resampling in host samples
+        int get_latency ();
+
+        // go back to the state of a new instance without reallocating anything
+        // so one instance can render many independent performances
+        // the rates, polyphony and pitch detection are kept so change those first
+        void reset ();
+
         // run the voice for one frame setting stereo output samples
         void run (float *out);
 
+        // run the voice for a block of frames into separate left and right buffers
+        void run_block (float *left, float *right, int frames);
+
+        // run the voice for a block of frames into an interleaved stereo buffer
+        void run_interleaved (float *out, int frames);
+
         // process a midi event
         void midi (uint8_t *data);
 
@@ -183,6 +422,12 @@ class Nanceloid {
         // get the id of the current shape
         int get_shape_id ();
 
+        // get the diameter of the current instantaneous shape using position 0 to 1
+        double get_diameter (double n);
+
+        // get the velic closure of the current instantaneous shape
+        double get_velic_closure ();
+
         // set the current shape given its id
         void set_shape_id (int id);
 
@@ -196,12 +441,30 @@ class Nanceloid {
         // -1 for not playing
         int playing_note ();
 
+        // set the number of voices that can play at once
+        // 1 is the monophonic voice, more than that plays them with a choir
+        // not to be called while running
+        void set_polyphony (int voices);
+
         // get the current intended playing frequency
         double get_frequency ();
 
         // get the current detected playing frequency
         double get_detected_frequency ();
 
+        // get the number of control ticks run so far
+        // the expensive work like pitch detection happens on those
+        long get_control_ticks ();
+
+        // choose how the playing pitch is detected
+        // only applies to the monophonic voice, the voices of a choir always use batch detection
+        void set_pitch_detection (PitchDetection mode);
+
+        // restart the noise of this instance from a seed
+        // along with batch or streaming pitch detection the same input then always renders the same output
+        // background detection depends on thread timing so it never does
+        void set_seed (uint64_t seed);
+
         // get the current voicing
         double get_voicing ();
 
@@ -214,7 +477,11 @@ class Nanceloid {
         // prepare the scope for viewing
         void prepare_scope ();
 
+#ifdef STAGE_COUNTERS
+        // get the cycles spent in each stage of rendering so far
+        StageCounters &get_stage_counters ();
+#endif
+
         // public members
         Parameters params;      // the live synth parameters
-        TractShape shape;       // the current instantaneous shape (not the preset)
 };
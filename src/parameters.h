@@ -89,6 +89,9 @@ struct Parameters {
     Parameter panning         = Parameter ("Panning",          "Panning",  "%",    -1,    1,   -100, 100,   0);
     Parameter volume          = Parameter ("Volume",           "Volume",   "%",     0,    1,    0,   100,   0.125);
 
+    // added later so they go last and the others keep the indices saved automation and presets refer to
+    Parameter junctions       = Parameter ("Junctions",        "Junction", "",      0,    128,  0,   128,   0);
+
     // return an array of the parameters
     Parameter *as_array () {
         return (Parameter *) this;
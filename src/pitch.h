@@ -0,0 +1,230 @@
+#pragma once
+
+#include <fft.h>
+#include <complex>
+#include <algorithm>
+
+// finds the period of a window of samples from the peaks of its auto correlation
+// the auto correlation is calculated as the inverse fft of the power spectrum
+class PitchDetector {
+    private:
+        int size = 0;                               // window size in samples
+        FFT fft;                                    // zero padded to at least twice the window
+        std::complex<double> *spectrum = nullptr;
+        double *auto_correlation = nullptr;
+
+        void free () {
+            delete[] spectrum;
+            delete[] auto_correlation;
+            spectrum = nullptr;
+            auto_correlation = nullptr;
+        }
+
+    public:
+        PitchDetector () {}
+        PitchDetector (const PitchDetector &) = delete;
+        PitchDetector &operator= (const PitchDetector &) = delete;
+
+        ~PitchDetector () {
+            free ();
+        }
+
+        // allocate for a given window size
+        void init (int size) {
+            free ();
+            this->size = size;
+            // padding to twice the size keeps the circular correlation from wrapping around
+            int fft_size = 1;
+            while (fft_size < size * 2)
+                fft_size *= 2;
+            fft.plan (fft_size);
+            spectrum = new std::complex<double>[fft_size];
+            auto_correlation = new double[size];
+        }
+
+        // get the window size
+        int get_size () {
+            return size;
+        }
+
+        // get the auto correlation at a given lag from the last detection
+        double get_auto_correlation (int lag) {
+            return auto_correlation[lag];
+        }
+
+        // find the lag of the highest peak of the auto correlation after lag 0
+        // the window is read from a ring buffer of the window size starting at the oldest sample
+        // returns 0 if there was no peak
+        template <typename T>
+        int detect (const T *ring, int start) {
+            int fft_size = fft.get_size ();
+
+            // load the window in time order and zero pad it
+            for (int i = 0; i < size; i++) {
+                int j = start + i;
+                if (j >= size)
+                    j -= size;
+                spectrum[i] = ring[j];
+            }
+            for (int i = size; i < fft_size; i++)
+                spectrum[i] = 0;
+
+            // auto correlation is the inverse transform of the power spectrum
+            fft.forward (spectrum);
+            for (int i = 0; i < fft_size; i++)
+                spectrum[i] = std::norm (spectrum[i]);
+            fft.inverse (spectrum);
+            for (int i = 0; i < size; i++)
+                auto_correlation[i] = spectrum[i].real () / fft_size;
+
+            // find peaks
+            int max_peak_i = 0;
+            bool last_was_down = false;
+            for (int i = 0; i < size; i++) {
+                double s = auto_correlation[i];
+                bool down = true;
+                if (i > 0)
+                    down = s < auto_correlation[i - 1];
+                if (down && !last_was_down) {
+                    // found a peak at i
+                    // ignore i = 0 because thats the first peak and we are looking for the second local maximum
+                    if (i > 0 && (max_peak_i == 0 || s > auto_correlation[max_peak_i]))
+                        max_peak_i = i;
+                }
+                last_was_down = down;
+            }
+            return max_peak_i;
+        }
+};
+
+// tracks the period of a stream of samples as they arrive
+// the auto correlation is exponentially windowed so it can be updated recursively every sample
+// and the peak search is spread over a hop of samples so every sample costs the same
+// only lags up to the longest period of interest are tracked since every one costs a multiply add per sample
+class PitchTracker {
+    private:
+        int size = 0;                       // window length in samples
+        int lags = 0;                       // number of lags tracked, a multiple of 4
+        int hop = 1;                        // samples per complete peak search
+        int scan_step = 1;                  // lags searched per sample
+        double decay = 0;                   // per sample decay of the window
+        double *history = nullptr;          // doubled ring buffer newest first so lags can be read contiguously
+        double *auto_correlation = nullptr;
+        int history_i = 0;
+        // peak search in progress
+        int scan_i = 0;
+        int max_peak_i = 0;
+        double max_peak = 0;
+        double last_s = 0;
+        bool last_was_down = false;
+        // last complete result
+        int period = 0;
+
+        void free () {
+            delete[] history;
+            delete[] auto_correlation;
+            history = nullptr;
+            auto_correlation = nullptr;
+        }
+
+        // past[k] is the sample k samples ago
+        // lags is a multiple of 4 so each pass of the loop is one or two vectors without a scalar remainder
+        static void update (double *__restrict ac, const double *__restrict past, double sample, double decay, int lags) {
+            for (int k = 0; k < lags; k += 4) {
+                ac[k] = ac[k] * decay + sample * past[k];
+                ac[k + 1] = ac[k + 1] * decay + sample * past[k + 1];
+                ac[k + 2] = ac[k + 2] * decay + sample * past[k + 2];
+                ac[k + 3] = ac[k + 3] * decay + sample * past[k + 3];
+            }
+        }
+
+    public:
+        PitchTracker () {}
+        PitchTracker (const PitchTracker &) = delete;
+        PitchTracker &operator= (const PitchTracker &) = delete;
+
+        ~PitchTracker () {
+            free ();
+        }
+
+        // allocate for a given window size, number of lags to track and number of samples between results
+        void init (int size, int lags, int hop) {
+            free ();
+            this->size = size;
+            this->lags = std::max (4, std::min ((lags + 3) & ~3, size & ~3));
+            this->hop = hop;
+            scan_step = (this->lags + hop - 1) / hop;
+            decay = exp (-1.0 / size);
+            history = new double[this->lags * 2];
+            auto_correlation = new double[this->lags];
+            reset ();
+        }
+
+        // forget every sample pushed so far
+        void reset () {
+            for (int i = 0; i < lags * 2; i++)
+                history[i] = 0;
+            for (int i = 0; i < lags; i++)
+                auto_correlation[i] = 0;
+            history_i = 0;
+            scan_i = 0;
+            max_peak_i = 0;
+            max_peak = 0;
+            last_s = 0;
+            last_was_down = false;
+            period = 0;
+        }
+
+        // add a sample
+        // returns true when a new period is available
+        bool push (double sample) {
+            // remember the sample twice going backwards so the last lags samples are always contiguous
+            if (history_i-- == 0)
+                history_i = lags - 1;
+            history[history_i] = sample;
+            history[history_i + lags] = sample;
+
+            // update the auto correlation at every tracked lag
+            update (auto_correlation, history + history_i, sample, decay, lags);
+
+            // continue the peak search
+            // lags are tapered like a finite window so shorter periods win over their multiples
+            int end = std::min (lags, scan_i + scan_step);
+            for (int i = scan_i; i < end; i++) {
+                double s = auto_correlation[i] * (size - i);
+                bool down = i > 0 ? s < last_s : true;
+                if (down && !last_was_down) {
+                    // found a peak at i
+                    // ignore i = 0 because thats the first peak and we are looking for the second local maximum
+                    if (i > 0 && (max_peak_i == 0 || s > max_peak)) {
+                        max_peak_i = i;
+                        max_peak = s;
+                    }
+                }
+                last_was_down = down;
+                last_s = s;
+            }
+            scan_i = end;
+
+            // publish the result when the search is complete
+            if (scan_i == lags) {
+                period = max_peak_i;
+                scan_i = 0;
+                max_peak_i = 0;
+                last_was_down = false;
+                return true;
+            }
+            return false;
+        }
+
+        // the period in samples found by the last complete search
+        // 0 if there was no peak
+        int get_period () {
+            return period;
+        }
+
+        // rms level of the window
+        double get_level () {
+            return sqrt (auto_correlation[0] * (1 - decay));
+        }
+};
@@ -0,0 +1,142 @@
+#include <iostream>
+#include <cstring>
+#include <cmath>
+#include <chrono>
+#include <unistd.h>
+#include <nanceloid.h>
+#include <midi_file.h>
+#include <wav.h>
+
+using namespace std;
+
+// the midi channel to render
+// -1 means omni
+int midi_channel = -1;
+
+const float default_sample_rate = 44100;
+const float default_tail = 2;
+const int block_size = 1024;    // most frames rendered between events
+
+void exit_error (string message) {
+    cerr << message << endl;
+    exit (EXIT_FAILURE);
+}
+
+void print_usage_and_exit (char *command) {
+    cerr << "Usage: " << command << " [-c channel] [-s sample rate] [-i internal rate] [-p pitch detection] [-v voices] [-t tail] [-f format] input.mid output.wav\n\n";
+    cerr << "-c channel\n\tSpecify the midi channel to render.\n\tIf left unspecified it will render all channels.\n\n";
+    cerr << "-s sample rate\n\tSpecify the sampling rate of the output in samples per second.\n\tIf left unspecified it is " << default_sample_rate << ".\n\n";
+    cerr << "-i internal rate\n\tSpecify the rate the voice is simulated at before resampling to the sample rate.\n\tIf left unspecified it is the sample rate.\n\n";
+    cerr << "-p pitch detection\n\tSpecify how the playing pitch is detected, either batch, streaming or background.\n\tWith more than one voice every voice uses batch.\n\tIf left unspecified it is batch.\n\n";
+    cerr << "-v voices\n\tSpecify the number of notes that can play at once.\n\tIf left unspecified it is 1.\n\n";
+    cerr << "-t tail\n\tSpecify the seconds to keep rendering after the last event.\n\tIf left unspecified it is " << default_tail << ".\n\n";
+    cerr << "-f format\n\tSpecify the sample format of the output, either 16, 24 or float.\n\tIf left unspecified it is 16.\n\n";
+    cerr << flush;
+    exit (EXIT_FAILURE);
+}
+
+int main (int argc, char **argv) {
+    // default cli args
+    float sample_rate = default_sample_rate;
+    float internal_rate = 0;
+    float tail = default_tail;
+    SampleFormat format = SAMPLE_INT16;
+    PitchDetection pitch_detection = PITCH_BATCH;
+    int voices = 1;
+
+    // parse cli args
+    int c;
+    while ((c = getopt (argc, argv, "c:s:i:p:v:t:f:")) != -1) {
+        switch (c) {
+            case 'c':
+                midi_channel = atoi (optarg);
+                break;
+            case 's':
+                sample_rate = atoi (optarg);
+                break;
+            case 'i':
+                internal_rate = atoi (optarg);
+                break;
+            case 'p':
+                if (!strcmp (optarg, "batch"))
+                    pitch_detection = PITCH_BATCH;
+                else if (!strcmp (optarg, "streaming"))
+                    pitch_detection = PITCH_STREAMING;
+                else if (!strcmp (optarg, "background"))
+                    pitch_detection = PITCH_BACKGROUND;
+                else
+                    print_usage_and_exit (argv[0]);
+                break;
+            case 'v':
+                voices = atoi (optarg);
+                break;
+            case 't':
+                tail = atof (optarg);
+                break;
+            case 'f':
+                if (!parse_sample_format (optarg, format))
+                    print_usage_and_exit (argv[0]);
+                break;
+            default:
+                print_usage_and_exit (argv[0]);
+        }
+    }
+    if (argc - optind != 2 || sample_rate <= 0)
+        print_usage_and_exit (argv[0]);
+    const char *input_path = argv[optind];
+    const char *output_path = argv[optind + 1];
+
+    // read the whole midi file up front
+    MidiFile midi_file;
+    if (!midi_file.load (input_path))
+        exit_error (string ("Could not read MIDI file ") + input_path);
+    const vector<MidiFile::Event> &events = midi_file.get_events ();
+
+    // setup the synth
+    Nanceloid *synth = new Nanceloid ();
+    synth->set_pitch_detection (pitch_detection);
+    synth->set_polyphony (voices);
+    synth->set_internal_rate (internal_rate);
+    synth->set_rate (sample_rate);
+
+    WavWriter wav;
+    if (!wav.open (output_path, sample_rate, 2, format))
+        exit_error (string ("Could not create WAV file ") + output_path);
+
+    // render from event to event so each one lands on its own frame
+    long total = (long) ceil ((midi_file.get_length () + fmax (0, tail)) * sample_rate);
+    float *buffer = new float[block_size * 2];
+    size_t next = 0;
+    long frame = 0;
+    auto start = chrono::steady_clock::now ();
+    while (frame < total) {
+        // send every event due by this frame
+        while (next < events.size () && (long) round (events[next].time * sample_rate) <= frame) {
+            MidiFile::Event event = events[next++];
+            if (midi_channel == -1 || (event.data[0] & 0x0f) == midi_channel)
+                synth->midi (event.data);
+        }
+
+        // render up to the next event
+        long until = total;
+        if (next < events.size ())
+            until = min (until, (long) round (events[next].time * sample_rate));
+        int frames = (int) min ((long) block_size, until - frame);
+        synth->run_interleaved (buffer, frames);
+        wav.write (buffer, frames);
+        frame += frames;
+    }
+    wav.close ();
+    double elapsed = chrono::duration<double> (chrono::steady_clock::now () - start).count ();
+
+    // report how much faster than realtime it was
+    double seconds = total / sample_rate;
+    cerr << "Rendered " << seconds << "s in " << elapsed << "s (" << seconds / fmax (elapsed, 1e-9) << "x realtime)" << endl;
+#ifdef STAGE_COUNTERS
+    synth->get_stage_counters ().print (cerr);
+#endif
+
+    delete[] buffer;
+    delete synth;
+    return 0;
+}
@@ -0,0 +1,157 @@
+#pragma once
+
+#include <cmath>
+#include <algorithm>
+
+// converts a stream from one sample rate to another with a polyphase windowed sinc filter
+// the ratio of the rates is output / input = up / down
+// conceptually the input is upsampled by up, low pass filtered and then every down-th sample is kept
+// but only the phase of the filter that lands on a kept sample is ever calculated
+class Resampler {
+    private:
+        int up = 1;
+        int down = 1;
+        int taps = 0;               // input samples per phase
+        float *filter = nullptr;    // taps coefficients for each phase, oldest input first
+        double *history = nullptr;  // doubled ring buffer so the last taps inputs are contiguous
+        int history_i = 0;
+        long phase = 0;             // time of the next output after the newest input in 1 / up samples
+
+        void free () {
+            delete[] filter;
+            delete[] history;
+            filter = nullptr;
+            history = nullptr;
+        }
+
+        // zeroth order modified bessel function of the first kind for the kaiser window
+        static double bessel_i0 (double x) {
+            double sum = 1;
+            double term = 1;
+            for (int k = 1; k < 32; k++) {
+                term *= (x / (2 * k)) * (x / (2 * k));
+                sum += term;
+            }
+            return sum;
+        }
+
+        void push (double sample) {
+            history[history_i] = sample;
+            history[history_i + taps] = sample;
+            if (++history_i == taps)
+                history_i = 0;
+        }
+
+    public:
+        Resampler () {}
+        Resampler (const Resampler &) = delete;
+        Resampler &operator= (const Resampler &) = delete;
+
+        ~Resampler () {
+            free ();
+        }
+
+        // find up and down for a ratio of rates with at most max_up phases
+        // ratios that need more phases are approximated by the nearest continued fraction
+        static void get_ratio (double input_rate, double output_rate, int max_up, int &up, int &down) {
+            double x = output_rate / input_rate;
+            long h0 = 0, h1 = 1;    // numerators of the last 2 convergents
+            long k0 = 1, k1 = 0;    // denominators
+            up = 1;
+            down = std::max (1, (int) round (1 / x));
+            for (int i = 0; i < 32; i++) {
+                long a = (long) floor (x);
+                long h = a * h1 + h0;
+                long k = a * k1 + k0;
+                if (h > max_up || k > max_up * 64L)
+                    break;
+                if (h > 0) {
+                    up = h;
+                    down = k;
+                }
+                h0 = h1;
+                h1 = h;
+                k0 = k1;
+                k1 = k;
+                double fraction = x - a;
+                if (fraction < 1e-9)
+                    break;
+                x = 1 / fraction;
+            }
+        }
+
+        // design the filter for a rational ratio of rates
+        // taps is the length of the filter in input samples when upsampling and grows with the ratio when downsampling
+        void init (int up, int down, int taps = 32) {
+            free ();
+            this->up = up;
+            this->down = down;
+            this->taps = (int) ceil (taps * std::max (1.0, (double) down / up));
+
+            // windowed sinc at the upsampled rate cutting off a little below the lower nyquist
+            const double rolloff = 0.9;
+            const double beta = 8;
+            int length = this->taps * up;
+            double cutoff = rolloff * 0.5 / std::max (up, down);
+            double center = (length - 1) / 2.0;
+            filter = new float[length];
+            for (int p = 0; p < up; p++) {
+                // the phase p uses every up-th coefficient starting from p
+                // stored oldest input first so it lines up with the history
+                double sum = 0;
+                for (int k = 0; k < this->taps; k++) {
+                    int m = p + k * up;
+                    double t = m - center;
+                    double sinc = t == 0 ? 1 : sin (2 * M_PI * cutoff * t) / (2 * M_PI * cutoff * t);
+                    double w = t / (center + 1);
+                    double window = bessel_i0 (beta * sqrt (std::max (0.0, 1 - w * w))) / bessel_i0 (beta);
+                    filter[p * this->taps + this->taps - 1 - k] = sinc * window;
+                    sum += sinc * window;
+                }
+                // every phase passes dc unchanged
+                for (int k = 0; k < this->taps; k++)
+                    filter[p * this->taps + k] /= sum;
+            }
+
+            history = new double[this->taps * 2];
+            reset ();
+        }
+
+        // forget every input so far
+        void reset () {
+            for (int i = 0; i < taps * 2; i++)
+                history[i] = 0;
+            history_i = 0;
+            // the first output lines up with the first input
+            phase = up;
+        }
+
+        // number of input samples needed to produce the next frames output samples
+        int get_input_needed (int frames) {
+            if (frames <= 0)
+                return 0;
+            return (int) ((phase + (long) (frames - 1) * down) / up);
+        }
+
+        // produce frames output samples from exactly get_input_needed (frames) input samples
+        void process (const double *input, double *output, int frames) {
+            for (int i = 0; i < frames; i++) {
+                while (phase >= up) {
+                    push (*input++);
+                    phase -= up;
+                }
+                const float *f = filter + phase * taps;
+                const double *h = history + history_i;
+                double sum = 0;
+                for (int k = 0; k < taps; k++)
+                    sum += f[k] * h[k];
+                output[i] = sum;
+                phase += down;
+            }
+        }
+
+        // delay of the filter in output samples
+        int get_latency () {
+            return (int) round ((taps * up - 1) / 2.0 / down);
+        }
+};
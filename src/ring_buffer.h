@@ -0,0 +1,69 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+
+// lock free queue for passing values from exactly one producer thread to exactly one consumer thread
+// neither side ever blocks or allocates after construction
+template <typename T>
+class RingBuffer {
+    private:
+        T *buffer;
+        size_t mask;
+        // kept on separate cache lines so the two threads don't fight over them
+        alignas (64) std::atomic<size_t> head {0};  // next slot to write, only written by the producer
+        alignas (64) std::atomic<size_t> tail {0};  // next slot to read, only written by the consumer
+
+    public:
+        // capacity is rounded up to a power of 2
+        RingBuffer (size_t capacity) {
+            size_t size = 1;
+            while (size < capacity)
+                size *= 2;
+            buffer = new T[size];
+            mask = size - 1;
+        }
+
+        RingBuffer (const RingBuffer &) = delete;
+        RingBuffer &operator= (const RingBuffer &) = delete;
+
+        ~RingBuffer () {
+            delete[] buffer;
+        }
+
+        // add a value from the producer thread
+        // returns false and drops the value if the queue is full
+        bool push (const T &value) {
+            size_t h = head.load (std::memory_order_relaxed);
+            if (h - tail.load (std::memory_order_acquire) > mask)
+                return false;
+            buffer[h & mask] = value;
+            head.store (h + 1, std::memory_order_release);
+            return true;
+        }
+
+        // look at the oldest value from the consumer thread without removing it
+        // returns nullptr if the queue is empty
+        T *peek () {
+            size_t t = tail.load (std::memory_order_relaxed);
+            if (t == head.load (std::memory_order_acquire))
+                return nullptr;
+            return &buffer[t & mask];
+        }
+
+        // remove the oldest value from the consumer thread
+        // returns false if the queue is empty
+        bool pop (T &value) {
+            T *front = peek ();
+            if (front == nullptr)
+                return false;
+            value = *front;
+            tail.store (tail.load (std::memory_order_relaxed) + 1, std::memory_order_release);
+            return true;
+        }
+
+        // remove all values from the consumer thread
+        void clear () {
+            tail.store (head.load (std::memory_order_acquire), std::memory_order_release);
+        }
+};
@@ -0,0 +1,129 @@
+#pragma once
+
+#include <algorithm>
+
+#if defined (__AVX__) || defined (__SSE2__)
+#include <immintrin.h>
+#endif
+
+// the range the travelling waves are clipped to
+const double wave_limit = 5;
+
+// clip without branching
+static inline double clip_wave (double value) {
+    return std::min (wave_limit, std::max (-wave_limit, value));
+}
+
+static inline float clip_wave (float value) {
+    return std::min ((float) wave_limit, std::max ((float) -wave_limit, value));
+}
+
+// kelly lochbaum scattering at the junctions in [begin, end) done in place
+// the junction j is between segments j and j + 1
+// it reads the waves r[j] and l[j + 1] and replaces them with the scattered r[j + 1] and l[j]
+// going up the tract only r[j + 1] is overwritten before it is read so its old value is carried along
+// refl_c is the amount of each reflection that survives damping
+static inline void scatter (double *r, double *l, const double *r_junction, const double *l_junction,
+                            int begin, int end, double refl_c) {
+    int j = begin;
+    double r_old = r[begin];
+#if defined (__AVX__)
+    const __m256d c = _mm256_set1_pd (refl_c);
+    const __m256d low = _mm256_set1_pd (-wave_limit);
+    const __m256d high = _mm256_set1_pd (wave_limit);
+    __m256d r0 = j + 4 <= end ? _mm256_loadu_pd (r + j) : _mm256_setzero_pd ();
+    for (; j + 4 <= end; j += 4) {
+        __m256d l1 = _mm256_loadu_pd (l + j + 1);
+        __m256d r_refl = _mm256_mul_pd (r0, _mm256_loadu_pd (r_junction + j));
+        __m256d l_refl = _mm256_mul_pd (l1, _mm256_loadu_pd (l_junction + j + 1));
+        __m256d r_out = _mm256_add_pd (_mm256_sub_pd (r0, r_refl), _mm256_mul_pd (l_refl, c));
+        __m256d l_out = _mm256_add_pd (_mm256_sub_pd (l1, l_refl), _mm256_mul_pd (r_refl, c));
+        // read ahead before the store overwrites r[j + 4]
+        r_old = r[j + 4];
+        if (j + 8 <= end)
+            r0 = _mm256_loadu_pd (r + j + 4);
+        _mm256_storeu_pd (r + j + 1, _mm256_min_pd (high, _mm256_max_pd (r_out, low)));
+        _mm256_storeu_pd (l + j, _mm256_min_pd (high, _mm256_max_pd (l_out, low)));
+    }
+#elif defined (__SSE2__)
+    const __m128d c = _mm_set1_pd (refl_c);
+    const __m128d low = _mm_set1_pd (-wave_limit);
+    const __m128d high = _mm_set1_pd (wave_limit);
+    __m128d r0 = j + 2 <= end ? _mm_loadu_pd (r + j) : _mm_setzero_pd ();
+    for (; j + 2 <= end; j += 2) {
+        __m128d l1 = _mm_loadu_pd (l + j + 1);
+        __m128d r_refl = _mm_mul_pd (r0, _mm_loadu_pd (r_junction + j));
+        __m128d l_refl = _mm_mul_pd (l1, _mm_loadu_pd (l_junction + j + 1));
+        __m128d r_out = _mm_add_pd (_mm_sub_pd (r0, r_refl), _mm_mul_pd (l_refl, c));
+        __m128d l_out = _mm_add_pd (_mm_sub_pd (l1, l_refl), _mm_mul_pd (r_refl, c));
+        // read ahead before the store overwrites r[j + 2]
+        r_old = r[j + 2];
+        if (j + 4 <= end)
+            r0 = _mm_loadu_pd (r + j + 2);
+        _mm_storeu_pd (r + j + 1, _mm_min_pd (high, _mm_max_pd (r_out, low)));
+        _mm_storeu_pd (l + j, _mm_min_pd (high, _mm_max_pd (l_out, low)));
+    }
+#endif
+    // whatever is left over or everything without simd
+    for (; j < end; j++) {
+        double r_refl = r_old * r_junction[j];
+        double l_refl = l[j + 1] * l_junction[j + 1];
+        double r_out = r_old - r_refl + l_refl * refl_c;
+        r_old = r[j + 1];
+        r[j + 1] = clip_wave (r_out);
+        l[j] = clip_wave (l[j + 1] - l_refl + r_refl * refl_c);
+    }
+}
+
+// the same in single precision with twice as many junctions per instruction
+static inline void scatter (float *r, float *l, const float *r_junction, const float *l_junction,
+                            int begin, int end, float refl_c) {
+    int j = begin;
+    float r_old = r[begin];
+#if defined (__AVX__)
+    const __m256 c = _mm256_set1_ps (refl_c);
+    const __m256 low = _mm256_set1_ps (-wave_limit);
+    const __m256 high = _mm256_set1_ps (wave_limit);
+    __m256 r0 = j + 8 <= end ? _mm256_loadu_ps (r + j) : _mm256_setzero_ps ();
+    for (; j + 8 <= end; j += 8) {
+        __m256 l1 = _mm256_loadu_ps (l + j + 1);
+        __m256 r_refl = _mm256_mul_ps (r0, _mm256_loadu_ps (r_junction + j));
+        __m256 l_refl = _mm256_mul_ps (l1, _mm256_loadu_ps (l_junction + j + 1));
+        __m256 r_out = _mm256_add_ps (_mm256_sub_ps (r0, r_refl), _mm256_mul_ps (l_refl, c));
+        __m256 l_out = _mm256_add_ps (_mm256_sub_ps (l1, l_refl), _mm256_mul_ps (r_refl, c));
+        // read ahead before the store overwrites r[j + 8]
+        r_old = r[j + 8];
+        if (j + 16 <= end)
+            r0 = _mm256_loadu_ps (r + j + 8);
+        _mm256_storeu_ps (r + j + 1, _mm256_min_ps (high, _mm256_max_ps (r_out, low)));
+        _mm256_storeu_ps (l + j, _mm256_min_ps (high, _mm256_max_ps (l_out, low)));
+    }
+#elif defined (__SSE2__)
+    const __m128 c = _mm_set1_ps (refl_c);
+    const __m128 low = _mm_set1_ps (-wave_limit);
+    const __m128 high = _mm_set1_ps (wave_limit);
+    __m128 r0 = j + 4 <= end ? _mm_loadu_ps (r + j) : _mm_setzero_ps ();
+    for (; j + 4 <= end; j += 4) {
+        __m128 l1 = _mm_loadu_ps (l + j + 1);
+        __m128 r_refl = _mm_mul_ps (r0, _mm_loadu_ps (r_junction + j));
+        __m128 l_refl = _mm_mul_ps (l1, _mm_loadu_ps (l_junction + j + 1));
+        __m128 r_out = _mm_add_ps (_mm_sub_ps (r0, r_refl), _mm_mul_ps (l_refl, c));
+        __m128 l_out = _mm_add_ps (_mm_sub_ps (l1, l_refl), _mm_mul_ps (r_refl, c));
+        // read ahead before the store overwrites r[j + 4]
+        r_old = r[j + 4];
+        if (j + 8 <= end)
+            r0 = _mm_loadu_ps (r + j + 4);
+        _mm_storeu_ps (r + j + 1, _mm_min_ps (high, _mm_max_ps (r_out, low)));
+        _mm_storeu_ps (l + j, _mm_min_ps (high, _mm_max_ps (l_out, low)));
+    }
+#endif
+    // whatever is left over or everything without simd
+    for (; j < end; j++) {
+        float r_refl = r_old * r_junction[j];
+        float l_refl = l[j + 1] * l_junction[j + 1];
+        float r_out = r_old - r_refl + l_refl * refl_c;
+        r_old = r[j + 1];
+        r[j + 1] = clip_wave (r_out);
+        l[j] = clip_wave (l[j + 1] - l_refl + r_refl * refl_c);
+    }
+}
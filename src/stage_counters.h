@@ -0,0 +1,136 @@
+#pragma once
+
+#include <cstdint>
+#include <iostream>
+#include <iomanip>
+#include <chrono>
+#include <algorithm>
+#if defined (__x86_64__) || defined (__i386__)
+#include <x86intrin.h>
+#endif
+
+// where the time goes in the synthesis loop
+// only built in with -D STAGE_COUNTERS, otherwise the STAGE macros are nothing at all
+//
+// every lap charges the ticks since the one before to a stage so the stages add up to the whole render
+// laps are tsc cycles on x86 and nanoseconds anywhere else
+class StageCounters {
+    public:
+        enum Stage {
+            STAGE_FOLDS,            // glottal folds and uvula integration
+            STAGE_JUNCTIONS,        // junctions next to the folds and uvula recomputed every sample
+            STAGE_NOSE_JUNCTION,    // tract ends and the nose throat mouth junction
+            STAGE_SCATTER,          // scattering along the tract and its segment delays
+            STAGE_NOSE,             // nose delay and radiation
+            STAGE_MIX,              // volume, scope, streaming pitch and panning
+            STAGE_AUTOCORRELATION,  // pitch detection at the control rate
+            STAGE_REFLECTIONS,      // update_reflections
+            STAGE_CROSSFADE,        // crossfade_shape
+            STAGE_CONTROL,          // the rest of the control tick
+            STAGE_CHOIR,            // every voice of the choir
+            STAGE_RESAMPLE,         // internal rate to sample rate
+            STAGES
+        };
+
+    private:
+        uint64_t ticks[STAGES] = {};
+        uint64_t laps[STAGES] = {};
+        uint64_t last = 0;
+        long samples = 0;
+        double overhead = 0;    // ticks a lap adds by itself
+
+        static uint64_t now () {
+#if defined (__x86_64__) || defined (__i386__)
+            return __rdtsc ();
+#else
+            return std::chrono::duration_cast<std::chrono::nanoseconds> (std::chrono::steady_clock::now ().time_since_epoch ()).count ();
+#endif
+        }
+
+        static const char *get_name (int stage) {
+            static const char *names[STAGES] = {
+                "folds", "junctions", "nose junction", "scatter", "nose", "mix",
+                "autocorrelation", "reflections", "crossfade", "control", "choir", "resample"
+            };
+            return names[stage];
+        }
+
+    public:
+        StageCounters () {
+            // time back to back laps so their own cost can be taken out of the counts
+            uint64_t best = UINT64_MAX;
+            for (int i = 0; i < 100; i++) {
+                uint64_t begin = now ();
+                for (int j = 0; j < 100; j++)
+                    lap (STAGE_MIX);
+                best = std::min (best, now () - begin);
+            }
+            overhead = best / 100.0;
+            clear ();
+        }
+
+        // start timing from here without charging anything
+        void start () {
+            last = now ();
+        }
+
+        // charge the ticks since the last lap to a stage
+        void lap (Stage stage) {
+            uint64_t time = now ();
+            ticks[stage] += time - last;
+            laps[stage]++;
+            last = time;
+        }
+
+        // count rendered samples to divide by
+        void add_samples (int count) {
+            samples += count;
+        }
+
+        void clear () {
+            for (int i = 0; i < STAGES; i++)
+                ticks[i] = laps[i] = 0;
+            samples = 0;
+        }
+
+        // get the ticks per sample spent in a stage without the cost of the laps
+        double get_ticks_per_sample (Stage stage) {
+            if (samples == 0)
+                return 0;
+            double total = ticks[stage] - laps[stage] * overhead;
+            return (total > 0 ? total : 0) / samples;
+        }
+
+        // display every stage
+        void print (std::ostream &out) {
+#if defined (__x86_64__) || defined (__i386__)
+            const char *unit = "cycles";
+#else
+            const char *unit = "ns";
+#endif
+            double total = 0;
+            for (int i = 0; i < STAGES; i++)
+                total += get_ticks_per_sample ((Stage) i);
+            out << "[stage]            [" << unit << "/sample]  [share]\n";
+            out << std::fixed;
+            for (int i = 0; i < STAGES; i++) {
+                double t = get_ticks_per_sample ((Stage) i);
+                out << std::setw (18) << std::left << get_name (i)
+                    << std::setw (16) << std::right << std::setprecision (1) << t
+                    << std::setw (8) << (total > 0 ? t / total * 100 : 0) << "%\n";
+            }
+            out << std::setw (18) << std::left << "total" << std::setw (16) << std::right << total << "\n";
+            out << "over " << samples << " samples, " << std::setprecision (1) << overhead << " " << unit << " taken out per lap\n";
+            out << std::defaultfloat << std::setprecision (6) << std::right << std::flush;
+        }
+};
+
+#ifdef STAGE_COUNTERS
+#define STAGE_START() stage_counters.start ()
+#define STAGE_LAP(stage) stage_counters.lap (StageCounters::stage)
+#define STAGE_SAMPLES(count) stage_counters.add_samples (count)
+#else
+#define STAGE_START()
+#define STAGE_LAP(stage)
+#define STAGE_SAMPLES(count)
+#endif
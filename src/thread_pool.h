@@ -0,0 +1,129 @@
+#pragma once
+
+#include <functional>
+#include <deque>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <algorithm>
+
+// runs jobs on a fixed set of threads
+// jobs are handed out round robin and each thread works through its own queue newest first
+// a thread that runs out steals the oldest jobs of the others so uneven jobs keep every thread busy
+// every job is told which thread runs it so it can use things kept per thread
+class ThreadPool {
+    public:
+        typedef std::function<void (int)> Job;
+
+    private:
+        struct Worker {
+            std::deque<Job> jobs;
+            std::mutex mutex;
+        };
+
+        int thread_count;
+        Worker *workers;
+        std::vector<std::thread> threads;
+        int next = 0;                       // worker given the next job
+        std::atomic<int> queued {0};        // jobs waiting in any queue
+        std::atomic<int> unfinished {0};    // jobs submitted and not done yet
+        bool running = true;
+        std::mutex mutex;                   // guards running and the waits below
+        std::condition_variable work_available;
+        std::condition_variable all_done;
+
+        // take a job from the back of our own queue or the front of another
+        bool take (int id, Job &job) {
+            for (int i = 0; i < thread_count; i++) {
+                Worker &worker = workers[(id + i) % thread_count];
+                std::lock_guard<std::mutex> lock (worker.mutex);
+                if (worker.jobs.empty ())
+                    continue;
+                if (i == 0) {
+                    job = std::move (worker.jobs.back ());
+                    worker.jobs.pop_back ();
+                } else {
+                    job = std::move (worker.jobs.front ());
+                    worker.jobs.pop_front ();
+                }
+                queued--;
+                return true;
+            }
+            return false;
+        }
+
+        void work (int id) {
+            while (true) {
+                Job job;
+                if (take (id, job)) {
+                    job (id);
+                    if (--unfinished == 0) {
+                        std::lock_guard<std::mutex> lock (mutex);
+                        all_done.notify_all ();
+                    }
+                    continue;
+                }
+                // sleep until there is something to take or it's time to stop
+                std::unique_lock<std::mutex> lock (mutex);
+                work_available.wait (lock, [this] { return !running || queued > 0; });
+                if (!running)
+                    return;
+            }
+        }
+
+    public:
+        // 0 threads uses one per core
+        ThreadPool (int threads = 0) {
+            if (threads <= 0)
+                threads = std::max (1u, std::thread::hardware_concurrency ());
+            thread_count = threads;
+            workers = new Worker[thread_count];
+            for (int i = 0; i < thread_count; i++)
+                this->threads.emplace_back (&ThreadPool::work, this, i);
+        }
+
+        ThreadPool (const ThreadPool &) = delete;
+        ThreadPool &operator= (const ThreadPool &) = delete;
+
+        // waits for the jobs already submitted
+        ~ThreadPool () {
+            wait ();
+            {
+                std::lock_guard<std::mutex> lock (mutex);
+                running = false;
+            }
+            work_available.notify_all ();
+            for (std::thread &thread : threads)
+                thread.join ();
+            delete[] workers;
+        }
+
+        // get the number of threads
+        int size () {
+            return thread_count;
+        }
+
+        // queue a job to be run on one of the threads
+        void submit (Job job) {
+            unfinished++;
+            Worker &worker = workers[next];
+            next = (next + 1) % thread_count;
+            {
+                std::lock_guard<std::mutex> lock (worker.mutex);
+                worker.jobs.push_back (std::move (job));
+            }
+            {
+                std::lock_guard<std::mutex> lock (mutex);
+                queued++;
+            }
+            work_available.notify_one ();
+        }
+
+        // block until every submitted job is done
+        void wait () {
+            std::unique_lock<std::mutex> lock (mutex);
+            all_done.wait (lock, [this] { return unfinished == 0; });
+        }
+};
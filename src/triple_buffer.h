@@ -0,0 +1,54 @@
+#pragma once
+
+#include <atomic>
+
+// lock free way for exactly one writer thread to hand the latest value of something to exactly one reader thread
+// the writer fills the back buffer and publishes it, the reader swaps in whatever was published last
+// neither side ever waits for the other and values the reader never got to are simply replaced
+template <typename T>
+class TripleBuffer {
+    private:
+        static const int fresh = 4;     // set on the spare index when it holds a value the reader hasn't seen
+
+        T *buffers;
+        int back = 0;                   // only used by the writer
+        int front = 1;                  // only used by the reader
+        // kept on its own cache line since both threads swap their buffer with it
+        alignas (64) std::atomic<int> spare {2};
+
+    public:
+        TripleBuffer () {
+            buffers = new T[3];
+        }
+
+        TripleBuffer (const TripleBuffer &) = delete;
+        TripleBuffer &operator= (const TripleBuffer &) = delete;
+
+        ~TripleBuffer () {
+            delete[] buffers;
+        }
+
+        // get the buffer to fill from the writer thread
+        T &get_back () {
+            return buffers[back];
+        }
+
+        // make the back buffer the latest value from the writer thread
+        void publish () {
+            back = spare.exchange (back | fresh, std::memory_order_acq_rel) & ~fresh;
+        }
+
+        // take the latest value from the reader thread
+        // returns false and keeps the current one if nothing new was published
+        bool update () {
+            if (!(spare.load (std::memory_order_relaxed) & fresh))
+                return false;
+            front = spare.exchange (front, std::memory_order_acq_rel) & ~fresh;
+            return true;
+        }
+
+        // get the value taken by the last update from the reader thread
+        T &get_front () {
+            return buffers[front];
+        }
+};
@@ -1,6 +1,7 @@
+#pragma once
+
 #include <audioeffectx.h>
 #include <nanceloid.h>
-#include <saw_source.h>
 #include <cmath>
 
 class NanceloidVST : public AudioEffectX {
@@ -21,8 +22,9 @@ class NanceloidVST : public AudioEffectX {
         bool getProductString (char *string);
         bool getVendorString (char *string);
 
+        // the parameters are the ones in Parameters in the same order
         void setParameter (VstInt32 index, float value);
-        float getParameter (VstInt32 index, float value);
+        float getParameter (VstInt32 index);
         void getParameterName (VstInt32 index, char *name);
         void getParameterLabel (VstInt32 index, char *label);
         void getParameterDisplay (VstInt32 index, char *string);
@@ -30,83 +32,12 @@ class NanceloidVST : public AudioEffectX {
     private:
         Nanceloid *synth;
 
-        // map a normalized value to a given range
-        double map_to_range (double value, double min, double max);
-
-        // return a normalized value given a range
-        double unmap_from_range (double value, double min, double max);
-};
-
-enum PARAMETER_TYPE {
-    LUNGS,
-    GLOTTIS,
-    LARYNX,
-    LIPS,
-    JAW,
-    FRONTNESS,
-    HEIGHT,
-    FLATNESS,
-    VELUM,
-    ACOUSTIC_DAMPING,
-    ENUNCIATION,
-    PORTAMENTO,
-    FRICATION,
-    SURFACE_TENSION,
-    TRACT_LENGTH,
-    AMBIENT_ADMITTANCE,
-    VIBRATO_RATE,
-    VIBRATO_DEPTH,
-    VELOCITY_WEIGHT,
-    PANNING,
-    VOLUME,
-
-    PARAMETER_COUNT
-};
-
-const char *parameter_names[PARAMETER_COUNT] = {
-    "Lungs",
-    "Glottis",
-    "Larynx",
-    "Lips",
-    "Jaw",
-    "Position",
-    "Height",
-    "Flatness",
-    "Velum",
-    "Damping",
-    "Enunc.",
-    "Portam.",
-    "Friction",
-    "Tension",
-    "Length",
-    "Amb. Y",
-    "Vib Rate",
-    "Vib Dep.",
-    "Velocity",
-    "Panning",
-    "Volume",
-};
-
-const char *parameter_labels[PARAMETER_COUNT] = {
-    "%",
-    "%",
-    "%",
-    "%",
-    "%",
-    "%",
-    "%",
-    "%",
-    "%",
-    "%",
-    "%",
-    "%",
-    "%",
-    "%",
-    "cm",
-    "℧",
-    "hz",
-    "cents",
-    "%",
-    "%",
-    "%",
+        // a midi event waiting for its frame in the next block
+        struct Event {
+            VstInt32 frame;
+            uint8_t data[3];
+        };
+        static const int max_events = 512;
+        Event events[max_events];
+        int event_count = 0;
 };
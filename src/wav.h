@@ -0,0 +1,158 @@
+#pragma once
+
+#include <cstdio>
+#include <cstdint>
+#include <cmath>
+#include <cstring>
+#include <vector>
+#include <convert.h>
+
+// writes interleaved float frames to a wav file as 16 or 24 bit pcm or 32 bit float
+// the sizes in the header are filled in when the file is closed
+// samples are written in the byte order of the machine which wav expects to be little endian
+class WavWriter {
+    private:
+        FILE *file = nullptr;
+        uint32_t rate = 44100;
+        int channels = 2;
+        SampleFormat format = SAMPLE_INT16;
+        uint32_t frames = 0;
+        SampleConverter converter;
+        uint8_t buffer[4096 * 4];
+
+        void write_u32 (uint32_t value) {
+            uint8_t bytes[4] = {(uint8_t) value, (uint8_t) (value >> 8), (uint8_t) (value >> 16), (uint8_t) (value >> 24)};
+            fwrite (bytes, 1, 4, file);
+        }
+
+        void write_u16 (uint16_t value) {
+            uint8_t bytes[2] = {(uint8_t) value, (uint8_t) (value >> 8)};
+            fwrite (bytes, 1, 2, file);
+        }
+
+        void write_header () {
+            int sample_size = get_sample_size (format);
+            uint32_t data_size = frames * channels * sample_size;
+            fwrite ("RIFF", 1, 4, file);
+            write_u32 (36 + data_size);
+            fwrite ("WAVEfmt ", 1, 8, file);
+            write_u32 (16);
+            write_u16 (format == SAMPLE_FLOAT32 ? 3 : 1);
+            write_u16 (channels);
+            write_u32 (rate);
+            write_u32 (rate * channels * sample_size);
+            write_u16 (channels * sample_size);
+            write_u16 (sample_size * 8);
+            fwrite ("data", 1, 4, file);
+            write_u32 (data_size);
+        }
+
+    public:
+        WavWriter () {}
+        WavWriter (const WavWriter &) = delete;
+        WavWriter &operator= (const WavWriter &) = delete;
+
+        ~WavWriter () {
+            close ();
+        }
+
+        // start a new file with samples in a given format
+        // returns false if it couldn't be created
+        bool open (const char *path, int rate, int channels, SampleFormat format) {
+            close ();
+            file = fopen (path, "wb");
+            if (file == nullptr)
+                return false;
+            this->rate = rate;
+            this->channels = channels;
+            this->format = format;
+            frames = 0;
+            write_header ();
+            return true;
+        }
+
+        // append frames of interleaved samples
+        void write (const float *samples, int frames) {
+            int count = frames * channels;
+            if (format == SAMPLE_FLOAT32) {
+                fwrite (samples, sizeof (float), count, file);
+            } else {
+                // convert a buffer at a time
+                int sample_size = get_sample_size (format);
+                for (int i = 0; i < count; i += 4096) {
+                    int n = count - i < 4096 ? count - i : 4096;
+                    converter.convert (samples + i, buffer, n, format);
+                    fwrite (buffer, sample_size, n, file);
+                }
+            }
+            this->frames += frames;
+        }
+
+        // fill in the header and close the file
+        void close () {
+            if (file == nullptr)
+                return;
+            fseek (file, 0, SEEK_SET);
+            write_header ();
+            fclose (file);
+            file = nullptr;
+        }
+
+        // frames written so far
+        uint32_t get_frames () {
+            return frames;
+        }
+};
+
+// reads a whole 16 or 24 bit pcm or 32 bit float wav file as interleaved floats
+// returns false if it couldn't be read or is in another format
+static inline bool read_wav (const char *path, std::vector<float> &samples, int &rate, int &channels) {
+    FILE *file = fopen (path, "rb");
+    if (file == nullptr)
+        return false;
+    std::vector<uint8_t> bytes;
+    uint8_t buffer[4096];
+    size_t n;
+    while ((n = fread (buffer, 1, sizeof (buffer), file)) > 0)
+        bytes.insert (bytes.end (), buffer, buffer + n);
+    fclose (file);
+
+    auto u16 = [&] (size_t i) { return (uint32_t) bytes[i] | bytes[i + 1] << 8; };
+    auto u32 = [&] (size_t i) { return u16 (i) | u16 (i + 2) << 16; };
+    if (bytes.size () < 12 || memcmp (&bytes[0], "RIFF", 4) || memcmp (&bytes[8], "WAVE", 4))
+        return false;
+
+    // walk the chunks for the format and the data
+    int format = 0;
+    int bits = 0;
+    size_t i = 12;
+    while (i + 8 <= bytes.size ()) {
+        uint32_t size = u32 (i + 4);
+        size_t body = i + 8;
+        if (size > bytes.size () - body)
+            return false;
+        if (!memcmp (&bytes[i], "fmt ", 4) && size >= 16) {
+            format = u16 (body);
+            channels = u16 (body + 2);
+            rate = u32 (body + 4);
+            bits = u16 (body + 14);
+        } else if (!memcmp (&bytes[i], "data", 4)) {
+            samples.clear ();
+            if (format == 3 && bits == 32) {
+                samples.resize (size / 4);
+                memcpy (samples.data (), &bytes[body], samples.size () * 4);
+            } else if (format == 1 && bits == 16) {
+                for (size_t k = 0; k + 1 < size; k += 2)
+                    samples.push_back ((int16_t) u16 (body + k) / 32767.0f);
+            } else if (format == 1 && bits == 24) {
+                for (size_t k = 0; k + 2 < size; k += 3)
+                    samples.push_back ((int32_t) ((u16 (body + k) | bytes[body + k + 2] << 16) << 8) / 256 / 8388607.0f);
+            } else {
+                return false;
+            }
+            return channels > 0;
+        }
+        i = body + size + (size & 1);
+    }
+    return false;
+}